@@ -23,6 +23,7 @@
 #undef DEBUG_LOG_HOST
 #undef DEBUG_SINGLE_STEP
 #undef DEBUG_DECODE
+#undef DEBUG_LOG_LATENCY
 
 
 #define WY60_VERSION PACKAGE_NAME" v"PACKAGE_VERSION" (" __DATE__ ")"
@@ -32,12 +33,14 @@ enum { E_NORMAL, E_ESC, E_SKIP_ONE, E_SKIP_LINE, E_SKIP_DEL, E_FILL_SCREEN,
        E_GOTO_SEGMENT, E_GOTO_ROW_CODE, E_GOTO_COLUMN_CODE, E_GOTO_ROW,
        E_GOTO_COLUMN, E_SET_FIELD_ATTRIBUTE, E_SET_ATTRIBUTE,
        E_GRAPHICS_CHARACTER, E_SET_FEATURES, E_FUNCTION_KEY,
-       E_SET_SEGMENT_POSITION, E_SELECT_PAGE, E_CSI_D, E_CSI_E };
+       E_SET_SEGMENT_POSITION, E_SET_SEGMENT_SPLIT, E_SELECT_PAGE, E_CSI_D,
+       E_CSI_E };
 enum { T_NORMAL = 0, T_BLANK = 1, T_BLINK = 2, T_REVERSE = 4,
        T_UNDERSCORE = 8, T_DIM = 64, T_BOTH = 68, T_ALL = 79,
        T_PROTECTED = 256, T_GRAPHICS = 512 };
 enum { J_AUTO = 0, J_ON, J_OFF };
 enum { P_OFF, P_TRANSPARENT, P_AUXILIARY };
+enum { F_OFF, F_BLOCK, F_SKIP };
 
 
 typedef struct KeyDefs {
@@ -49,9 +52,47 @@ typedef struct KeyDefs {
 } KeyDefs;
 
 
+/* Each character cell packs the glyph into the low byte and the attributes  */
+/* (including the protected and graphics flags) into the upper 16 bits. All  */
+/* cells of a screen buffer live in one contiguous, row-major block.         */
+typedef unsigned int Cell;
+
+#define CELL(attributes, ch)   (((Cell)(unsigned short)(attributes) << 16) | \
+                                (Cell)(unsigned char)(ch))
+#define CELL_CHARACTER(cell)   ((char)((cell) & 0xFF))
+#define CELL_ATTRIBUTES(cell)  ((unsigned short)((cell) >> 16))
+#define CELL_ATTRIBUTE_MASK    ((Cell)0xFFFF0000)
+#define BLANK_CELL             CELL(T_NORMAL, ' ')
+
+
+/* Optionally, every row also keeps a sorted list of attribute runs. Each    */
+/* run extends up to the start of the next one, and the first run always     */
+/* starts in column zero. Adjacent runs never share the same attributes.     */
+/* The cells remain authoritative; the runs only speed up searching for      */
+/* attribute changes.                                                        */
+typedef struct AttributeSpan {
+  unsigned short start;
+  unsigned short attributes;
+} AttributeSpan;
+
+
+typedef struct SpanList {
+  AttributeSpan  *spans;
+  int            count;
+  int            size;
+} SpanList;
+
+
+/* A page of memory can be taller than the display. "cells" and "spanLists"  */
+/* then point to the rows at "viewportY" within "memory" and "spanMemory",   */
+/* and all row coordinates outside of the page memory handling code are      */
+/* relative to the visible viewport.                                         */
 typedef struct ScreenBuffer {
-  unsigned short **attributes;
-  char           **lineBuffer;
+  Cell           **cells;
+  SpanList       *spanLists;
+  Cell           **memory;
+  SpanList       *spanMemory;
+  int            viewportY;
   int            cursorX;
   int            cursorY;
   int            maximumWidth;
@@ -59,18 +100,68 @@ typedef struct ScreenBuffer {
 } ScreenBuffer;
 
 
+/* Lines that scroll off the top of page 0 are kept in a history store. The  */
+/* unique lines are encoded compactly, packed into blocks that get           */
+/* compressed once they are full, and found again through a hash table, so   */
+/* that repeated lines (e.g. form borders) are only stored once.             */
+typedef struct HistoryBlock {
+  unsigned char  *data;
+  int            length;
+  int            rawLength;
+  int            isCompressed;
+  int            references;
+} HistoryBlock;
+
+
+typedef struct HistoryLine {
+  struct HistoryLine *next;
+  HistoryBlock       *block;
+  unsigned int       hash;
+  int                offset;
+  int                length;
+  int                references;
+} HistoryLine;
+
+
+/* Keystrokes that are expected to be echoed by the application. While the   */
+/* echo is in transit, the predicted character is shown on the terminal,     */
+/* but it never gets entered into the screen buffer.                         */
+typedef struct Prediction {
+  int                x, y;
+  char               ch;
+  Cell               original;
+  int                shown;
+  long               time;
+} Prediction;
+
+
+static int  capabilityCost(const char *capability);
+static long currentTime(void);
 static void failure(int exitCode, const char *message, ...);
 static void flushConsole(void);
+static void flushCursor(void);
+static void flushEdits(void);
+static void flushScroll(void);
+static void gotoXY(int x, int y);
 static void gotoXYforce(int x, int y);
+static void outputCharacter(int pty, char ch);
 static void processSignal(int signalNumber, int pid, int pty);
 static void putCapability(const char *capability);
 static int  putConsole(int ch);
 static void putGraphics(char ch);
+static void sendScreen(int pty, int fromStartOfRow, int unprotectedOnly,
+                       int toEndOfPage);
+static int  shiftHostLines(int top, int bottom, int count);
+static void setHostCursor(int flag);
 static void showCursor(int flag);
+static int  showPredictedCursor(void);
 static void updateAttributes(void);
+static void wrapCursor(void);
+static int  desiredAttributes(void);
 
 
 static int            euid, egid, uid, gid, oldStylePty, streamsIO, jobControl;
+static int            packetMode, outputStopped;
 static char           ptyName[40];
 static struct termios defaultTermios;
 static sigjmp_buf     mainJumpBuffer, auxiliaryJumpBuffer;
@@ -95,6 +186,43 @@ static char           outputBuffer[16384];
 static int            outputBufferLength;
 static char           inputBuffer[128];
 static int            inputBufferLength;
+static int            useAttributeSpans;
+static HistoryLine    **historyLines, *historyHash[4096];
+static HistoryBlock   *openHistoryBlock, *cachedHistoryBlock;
+static unsigned char  cachedHistoryData[8192];
+static int            historySize, historyStart, historyCount;
+static long           historyMemory, historyLimit;
+static int            historyViewOffset = -1;
+static long           compactionTime, resizeTime;
+static int            pageFactor[3] = { 1, 1, 1 };
+static int            hostScreenPage[2] = { 0, -1 };
+static int            hostScreenViewport[2];
+static ScreenBuffer   *historyView;
+static int            cursorPending, cursorUnknown, hostCursorX, hostCursorY;
+static int            cursorWrapped, cursorWrapY, scrollPending;
+static int            scrollTop, scrollBottom;
+static int            hostCursorIsHidden, cursorBurst, cursorBurstSize;
+static int            blankCount, blankX, blankY, blankTail;
+static int            blankDirtyStart, blankDirtyEnd;
+static int            checkpointLength = -1, checkpointTrial;
+static int            checkpointWidth, checkpointHeight, checkpointSize;
+static int            checkpointAttributes, checkpointCursorHidden;
+static int            checkpointX, checkpointY;
+static ScreenBuffer   *checkpointBuffer;
+static Cell           *checkpointCells;
+static int            shiftCount, shiftX, shiftY;
+static int            insertRunCount, insertRunX, insertRunY;
+static Cell           *insertRunTail;
+static unsigned int   *checkpointHashes;
+static const char     historyKey[] = "";
+static int            predictiveEcho, predictionCount, predictionFailed;
+static int            predictionConfirmed, localEditMode, blockMode;
+static int            segmentSplit, activeSegment;
+static int            segmentCursorX, segmentCursorY;
+static int            flowControl, highWatermark, lowWatermark;
+static int            skippingOutput, skipPage;
+static int            outputBaudRate;
+static Prediction     predictions[64];
 
 
 static char *cfgTerm            = "wyse60";
@@ -103,6 +231,14 @@ static char *cfgIdentifier      = "\x06";
 static char *cfgResize          = "";
 static char *cfgWriteProtect    = "";
 static char *cfgPrintCommand    = "auto";
+static char *cfgAttributeSpans  = "off";
+static char *cfgScrollback      = "0";
+static char *cfgScrollbackKey   = "";
+static char *cfgHideCursor      = "0";
+static char *cfgPredictiveEcho  = "off";
+static char *cfgFlowControl     = "off";
+static char *cfgHighWatermark   = "2048";
+static char *cfgLowWatermark    = "";
 static char *cfgA1              = "";
 static char *cfgA3              = "";
 static char *cfgB2              = "";
@@ -499,6 +635,40 @@ static void logDecodeFlush(void) { return; }
 #endif
 
 
+#ifdef DEBUG_LOG_LATENCY
+static void logLatency(long waitingSince) {
+  /* Records how long keyboard input had to wait, before it was forwarded to */
+  /* the application; and the worst case that we have seen so far.           */
+  static int  logFd = -2;
+  static long worstDelay;
+
+  if (logFd == -2) {
+    char *logger;
+
+    if ((logger    = getenv("WY60LATENCY")) != NULL) {
+      logFd        = creat(logger, 0644);
+    } else
+      logFd        = -1;
+  }
+
+  if (logFd >= 0) {
+    char buffer[80];
+    long delay;
+
+    delay        = currentTime() - waitingSince;
+    if (delay > worstDelay)
+      worstDelay = delay;
+    sprintf(buffer, "keystroke delay %ldms, worst case %ldms\n",
+            delay, worstDelay);
+    write(logFd, buffer, strlen(buffer));
+  }
+  return;
+}
+#else
+#define logLatency(waitingSince) do {} while (0)
+#endif
+
+
 #if !HAVE_SYS_POLL_H
 struct pollfd {
   int fd;
@@ -565,9 +735,12 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #if !HAVE_TERM_H && !HAVE_NCURSES_TERM_H
 #undef  auto_right_margin
 #undef  eat_newline_glitch
+#undef  xon_xoff
+#undef  padding_baud_rate
 #undef  acs_chars
 #undef  bell
 #undef  carriage_return
+#undef  change_scroll_region
 #undef  clear_screen
 #undef  clr_eol
 #undef  clr_eos
@@ -584,6 +757,7 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #undef  delete_line
 #undef  ena_acs
 #undef  enter_alt_charset_mode
+#undef  enter_am_mode
 #undef  enter_blink_mode
 #undef  enter_bold_mode
 #undef  enter_ca_mode
@@ -591,7 +765,9 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #undef  enter_insert_mode
 #undef  enter_standout_mode
 #undef  enter_underline_mode
+#undef  erase_chars
 #undef  exit_alt_charset_mode
+#undef  exit_am_mode
 #undef  exit_attribute_mode
 #undef  exit_ca_mode
 #undef  exit_insert_mode
@@ -754,8 +930,11 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #undef  key_undo
 #undef  key_up
 #undef  orig_pair
+#undef  parm_dch
 #undef  parm_delete_line
 #undef  parm_down_cursor
+#undef  parm_ich
+#undef  parm_index
 #undef  parm_insert_line
 #undef  parm_left_cursor
 #undef  parm_right_cursor
@@ -765,6 +944,7 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #undef  reset_3string
 #undef  reset_file
 #undef  scroll_forward
+#undef  scroll_reverse
 #undef  set_a_foreground
 #undef  set_attributes
 #undef  set_foreground
@@ -772,9 +952,12 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 
 #define auto_right_margin      wy60_auto_right_margin
 #define eat_newline_glitch     wy60_eat_newline_glitch
+#define xon_xoff               wy60_xon_xoff
+#define padding_baud_rate      wy60_padding_baud_rate
 #define acs_chars              wy60_acs_chars
 #define bell                   wy60_bell
 #define carriage_return        wy60_carriage_return
+#define change_scroll_region   wy60_change_scroll_region
 #define clear_screen           wy60_clear_screen
 #define clr_eol                wy60_clr_eol
 #define clr_eos                wy60_clr_eos
@@ -791,6 +974,7 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #define delete_line            wy60_delete_line
 #define ena_acs                wy60_ena_acs
 #define enter_alt_charset_mode wy60_enter_alt_charset_mode
+#define enter_am_mode          wy60_enter_am_mode
 #define enter_blink_mode       wy60_enter_blink_mode
 #define enter_bold_mode        wy60_enter_bold_mode
 #define enter_ca_mode          wy60_enter_ca_mode
@@ -798,7 +982,9 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #define enter_insert_mode      wy60_enter_insert_mode
 #define enter_standout_mode    wy60_enter_standout_mode
 #define enter_underline_mode   wy60_enter_underline_mode
+#define erase_chars            wy60_erase_chars
 #define exit_alt_charset_mode  wy60_exit_alt_charset_mode
+#define exit_am_mode           wy60_exit_am_mode
 #define exit_attribute_mode    wy60_exit_attribute_mode
 #define exit_ca_mode           wy60_exit_ca_mode
 #define exit_insert_mode       wy60_exit_insert_mode
@@ -961,8 +1147,11 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #define key_undo               wy60_key_undo
 #define key_up                 wy60_key_up
 #define orig_pair              wy60_orig_pair
+#define parm_dch               wy60_parm_dch
 #define parm_delete_line       wy60_parm_delete_line
 #define parm_down_cursor       wy60_parm_down_cursor
+#define parm_ich               wy60_parm_ich
+#define parm_index             wy60_parm_index
 #define parm_insert_line       wy60_parm_insert_line
 #define parm_left_cursor       wy60_parm_left_cursor
 #define parm_right_cursor      wy60_parm_right_cursor
@@ -972,6 +1161,7 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 #define reset_3string          wy60_reset_3string
 #define reset_file             wy60_reset_file
 #define scroll_forward         wy60_scroll_forward
+#define scroll_reverse         wy60_scroll_reverse
 #define set_a_foreground       wy60_set_a_foreground
 #define set_attributes         wy60_set_attributes
 #define set_foreground         wy60_set_foreground
@@ -979,10 +1169,13 @@ static int poll(struct pollfd *fds, unsigned long nfds, int timeout) {
 
 static int        auto_right_margin;
 static int        eat_newline_glitch;
+static int        xon_xoff;
+static int        padding_baud_rate;
 
 static const char *acs_chars;
 static const char *bell;
 static const char *carriage_return;
+static const char *change_scroll_region;
 static const char *clear_screen;
 static const char *clr_eol;
 static const char *clr_eos;
@@ -999,6 +1192,7 @@ static const char *delete_character;
 static const char *delete_line;
 static const char *ena_acs;
 static const char *enter_alt_charset_mode;
+static const char *enter_am_mode;
 static const char *enter_blink_mode;
 static const char *enter_bold_mode;
 static const char *enter_ca_mode;
@@ -1006,7 +1200,9 @@ static const char *enter_dim_mode;
 static const char *enter_insert_mode;
 static const char *enter_standout_mode;
 static const char *enter_underline_mode;
+static const char *erase_chars;
 static const char *exit_alt_charset_mode;
+static const char *exit_am_mode;
 static const char *exit_attribute_mode;
 static const char *exit_ca_mode;
 static const char *exit_insert_mode;
@@ -1169,8 +1365,11 @@ static const char *key_suspend;
 static const char *key_undo;
 static const char *key_up;
 static const char *orig_pair;
+static const char *parm_dch;
 static const char *parm_delete_line;
 static const char *parm_down_cursor;
+static const char *parm_ich;
+static const char *parm_index;
 static const char *parm_insert_line;
 static const char *parm_left_cursor;
 static const char *parm_right_cursor;
@@ -1180,6 +1379,7 @@ static const char *reset_2string;
 static const char *reset_3string;
 static const char *reset_file;
 static const char *scroll_forward;
+static const char *scroll_reverse;
 static const char *set_a_foreground;
 static const char *set_attributes;
 static const char *set_foreground;
@@ -1197,6 +1397,7 @@ static int setupterm(const char *term, int fildes, int *errret) {
     { &acs_chars,             "ac" },
     { &bell,                  "bl" },
     { &carriage_return,       "cr" },
+    { &change_scroll_region,  "cs" },
     { &clear_screen,          "cl" },
     { &clr_eol,               "ce" },
     { &clr_eos,               "cd" },
@@ -1213,6 +1414,7 @@ static int setupterm(const char *term, int fildes, int *errret) {
     { &delete_line,           "dl" },
     { &ena_acs,               "eA" },
     { &enter_alt_charset_mode,"as" },
+    { &enter_am_mode,         "SA" },
     { &enter_blink_mode,      "mb" },
     { &enter_bold_mode,       "md" },
     { &enter_ca_mode,         "ti" },
@@ -1220,7 +1422,9 @@ static int setupterm(const char *term, int fildes, int *errret) {
     { &enter_insert_mode,     "im" },
     { &enter_standout_mode,   "so" },
     { &enter_underline_mode,  "us" },
+    { &erase_chars,           "ec" },
     { &exit_alt_charset_mode, "ae" },
+    { &exit_am_mode,          "RA" },
     { &exit_attribute_mode,   "me" },
     { &exit_ca_mode,          "te" },
     { &exit_insert_mode,      "ei" },
@@ -1383,8 +1587,11 @@ static int setupterm(const char *term, int fildes, int *errret) {
     { &key_undo,              "&8" },
     { &key_up,                "ku" },
     { &orig_pair,             "ke" },
+    { &parm_dch,              "DC" },
     { &parm_delete_line,      "ks" },
     { &parm_down_cursor,      "DO" },
+    { &parm_ich,              "IC" },
+    { &parm_index,            "SF" },
     { &parm_insert_line,      "AL" },
     { &parm_left_cursor,      "LE" },
     { &parm_right_cursor,     "RI" },
@@ -1394,6 +1601,7 @@ static int setupterm(const char *term, int fildes, int *errret) {
     { &reset_3string,         "r3" },
     { &reset_file,            "rf" },
     { &scroll_forward,        "sf" },
+    { &scroll_reverse,        "sr" },
     { &set_a_foreground,      "AF" },
     { &set_attributes,        "sa" },
     { &set_foreground,        "Sf" } };
@@ -1434,6 +1642,10 @@ static int setupterm(const char *term, int fildes, int *errret) {
   /* Look up boolean flags.                                                  */
   auto_right_margin         = tgetflag("am");
   eat_newline_glitch        = tgetflag("xn");
+  xon_xoff                  = tgetflag("xo");
+
+  /* Look up numeric entries.                                                */
+  padding_baud_rate         = tgetnum("pb");
 
   /* Look up string entries.                                                 */
   for (i = sizeof(termDefs)/sizeof(struct TermDefs); i--; ) {
@@ -2112,20 +2324,186 @@ static int logicalHeight(void) {
 }
 
 
+static void fillCells(Cell *cells, Cell value, int count) {
+  /* Plain, branch-free loop over a contiguous run of cells; compilers turn  */
+  /* this into wide vector stores.                                           */
+  int i;
+
+  for (i = 0; i < count; i++)
+    cells[i]                        = value;
+  return;
+}
+
+
+static int compareCells(const Cell *a, const Cell *b, int count) {
+  /* Returns the index of the first cell that differs, or "count" if both    */
+  /* runs are identical. Cells are compared in blocks of eight without an    */
+  /* early exit in the inner loop, so that the comparison can be vectorized. */
+  int i, j;
+
+  for (i = 0; i + 8 <= count; i += 8) {
+    Cell difference                 = 0;
+    for (j = 0; j < 8; j++)
+      difference                   |= a[i + j] ^ b[i + j];
+    if (difference)
+      break;
+  }
+  for (; i < count; i++)
+    if (a[i] != b[i])
+      break;
+  return(i);
+}
+
+
+static int attributeRunLength(const Cell *cells, int count) {
+  /* Returns the number of leading cells that share the attributes of the    */
+  /* first cell.                                                             */
+  Cell attributes                   = cells[0] & CELL_ATTRIBUTE_MASK;
+  int  i;
+
+  for (i = 1; i < count; i++)
+    if ((cells[i] & CELL_ATTRIBUTE_MASK) != attributes)
+      break;
+  return(i);
+}
+
+
+static int findAttributeSpan(const SpanList *spanList, int x) {
+  /* Returns the index of the run that covers column "x".                    */
+  int low                           = 0;
+  int high                          = spanList->count - 1;
+
+  while (low < high) {
+    int middle                      = (low + high + 1) / 2;
+    if (spanList->spans[middle].start <= x)
+      low                           = middle;
+    else
+      high                          = middle - 1;
+  }
+  return(low);
+}
+
+
+static void insertAttributeSpan(SpanList *spanList, int index,
+                                int start, int attributes) {
+  if (spanList->count == spanList->size) {
+    spanList->size                 *= 2;
+    spanList->spans                 = realloc(spanList->spans,
+                                              spanList->size *
+                                              sizeof(AttributeSpan));
+  }
+  memmove(&spanList->spans[index + 1], &spanList->spans[index],
+          (spanList->count - index) * sizeof(AttributeSpan));
+  spanList->spans[index].start      = start;
+  spanList->spans[index].attributes = attributes;
+  spanList->count++;
+  return;
+}
+
+
+static void setAttributeSpan(ScreenBuffer *screenBuffer, int y,
+                             int x1, int x2, int attributes) {
+  /* Changes the attributes for columns x1..x2. Any runs that start inside   */
+  /* of this range are removed, the run that used to cover x2+1 is split,    */
+  /* and the new run is merged with its neighbors if they are identical.     */
+  SpanList *spanList                = &screenBuffer->spanLists[y];
+  int      first, last;
+  int      tailAttributes           = -1;
+
+  first                             = findAttributeSpan(spanList, x1);
+  if (spanList->spans[first].start < x1)
+    first++;
+  if (x2 + 1 < screenBuffer->maximumWidth) {
+    last                            = findAttributeSpan(spanList, x2 + 1);
+    tailAttributes                  = spanList->spans[last].attributes;
+    last++;
+  } else
+    last                            = spanList->count;
+  if (last > first) {
+    memmove(&spanList->spans[first], &spanList->spans[last],
+            (spanList->count - last) * sizeof(AttributeSpan));
+    spanList->count                -= last - first;
+  }
+  if (first == 0 || spanList->spans[first - 1].attributes != attributes)
+    insertAttributeSpan(spanList, first++, x1, attributes);
+  if (tailAttributes >= 0 && tailAttributes != attributes)
+    insertAttributeSpan(spanList, first, x2 + 1, tailAttributes);
+  return;
+}
+
+
+static void refreshAttributeSpans(ScreenBuffer *screenBuffer,
+                                  int y1, int y2) {
+  /* Rebuilds the attribute runs from the cells after bulk changes to the    */
+  /* screen buffer.                                                          */
+  if (screenBuffer->spanLists) {
+    int width                       = screenBuffer->maximumWidth;
+    int x, y, run;
+
+    for (y = y1; y <= y2; y++) {
+      SpanList *spanList            = &screenBuffer->spanLists[y];
+      Cell     *cellPtr             = screenBuffer->cells[y];
+
+      spanList->count               = 0;
+      for (x = 0; x < width; x += run) {
+        run                         = attributeRunLength(cellPtr + x,
+                                                         width - x);
+        insertAttributeSpan(spanList, spanList->count, x,
+                            CELL_ATTRIBUTES(cellPtr[x]));
+      }
+    }
+  }
+  return;
+}
+
+
+static int attributeRun(ScreenBuffer *screenBuffer, int x, int y,
+                        int count) {
+  /* Returns the number of cells starting at (x,y) that share the same       */
+  /* attributes, but never more than "count".                                */
+  if (screenBuffer->spanLists) {
+    SpanList *spanList              = &screenBuffer->spanLists[y];
+    int      index                  = findAttributeSpan(spanList, x);
+
+    if (index + 1 < spanList->count &&
+        spanList->spans[index + 1].start - x < count)
+      return(spanList->spans[index + 1].start - x);
+    return(count);
+  }
+  return(attributeRunLength(&screenBuffer->cells[y][x], count));
+}
+
+
+static void putCell(ScreenBuffer *screenBuffer, int x, int y, Cell cell) {
+  Cell *cellPtr                     = &screenBuffer->cells[y][x];
+
+  if (screenBuffer->spanLists && ((*cellPtr ^ cell) & CELL_ATTRIBUTE_MASK))
+    setAttributeSpan(screenBuffer, y, x, x, CELL_ATTRIBUTES(cell));
+  *cellPtr                          = cell;
+  return;
+}
+
+
+static void setViewport(ScreenBuffer *screenBuffer, int viewportY) {
+  screenBuffer->viewportY       = viewportY;
+  screenBuffer->cells           = screenBuffer->memory + viewportY;
+  if (screenBuffer->spanMemory)
+    screenBuffer->spanLists     = screenBuffer->spanMemory + viewportY;
+  return;
+}
+
+
 static void _clearScreenBuffer(ScreenBuffer *screenBuffer,
                                int x1, int y1, int x2, int y2,
                                unsigned short attributes, char fillChar) {
   if (x1 <= x2 && y1 <= y2) {
-    int x, y;
+    Cell value                      = CELL(attributes, fillChar);
+    int  y;
 
     for (y = y1; y <= y2; y++) {
-      unsigned short *attributesPtr = &screenBuffer->attributes[y][x1];
-      char *linePtr                 = &screenBuffer->lineBuffer[y][x1];
-      
-      for (x = x1; x <= x2; x++) {
-        *attributesPtr++            = attributes;
-      }
-      memset(linePtr, fillChar, x2 - x1 + 1);
+      fillCells(&screenBuffer->cells[y][x1], value, x2 - x1 + 1);
+      if (screenBuffer->spanLists)
+        setAttributeSpan(screenBuffer, y, x1, x2, attributes);
     }
   }
   return;
@@ -2152,16 +2530,28 @@ static void clearExcessBuffers(void) {
   if (needsClearingBuffers) {
     int i;
     for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++) {
+      int viewportY, rows;
+
+      if (screenBuffer[i] == NULL)
+        continue;
+
+      /* Clear everything outside of the page memory. This operates on       */
+      /* absolute row numbers, so temporarily move the viewport to the top.  */
+      viewportY             = screenBuffer[i]->viewportY;
+      rows                  = pageFactor[i] * screenHeight;
+      setViewport(screenBuffer[i], 0);
       _clearScreenBuffer(screenBuffer[i],
-                         0, screenHeight,
+                         0, rows,
                          screenBuffer[i]->maximumWidth - 1,
                          screenBuffer[i]->maximumHeight - 1,
                          T_NORMAL, ' ');
       _clearScreenBuffer(screenBuffer[i],
                          screenWidth, 0,
                          screenBuffer[i]->maximumWidth - 1,
-                         screenHeight - 1,
+                         (rows < screenBuffer[i]->maximumHeight
+                          ? rows : screenBuffer[i]->maximumHeight) - 1,
                          T_NORMAL, ' ');
+      setViewport(screenBuffer[i], viewportY);
     }
     needsClearingBuffers        = 0;
   }
@@ -2194,24 +2584,19 @@ static void _moveScreenBuffer(ScreenBuffer *screenBuffer,
     if (dy < 0) {
       /* Moving up                                                           */
       for (y = y1; y <= y2; y++) {
-        memmove(&screenBuffer->attributes[y + dy][x1 + dx],
-                &screenBuffer->attributes[y     ][x1     ],
-                w * sizeof(unsigned short));
-        memmove(&screenBuffer->lineBuffer[y + dy][x1 + dx],
-                &screenBuffer->lineBuffer[y     ][x1     ],
-                w * sizeof(char));
+        memmove(&screenBuffer->cells[y + dy][x1 + dx],
+                &screenBuffer->cells[y     ][x1     ],
+                w * sizeof(Cell));
       }
     } else {
       /* Moving down                                                         */
       for (y = y2 + 1; --y >= y1; ) {
-        memmove(&screenBuffer->attributes[y + dy][x1 + dx],
-                &screenBuffer->attributes[y     ][x1     ],
-                w * sizeof(unsigned short));
-        memmove(&screenBuffer->lineBuffer[y + dy][x1 + dx],
-                &screenBuffer->lineBuffer[y     ][x1     ],
-                w * sizeof(char));
+        memmove(&screenBuffer->cells[y + dy][x1 + dx],
+                &screenBuffer->cells[y     ][x1     ],
+                w * sizeof(Cell));
       }
     }
+    refreshAttributeSpans(screenBuffer, y1 + dy, y2 + dy);
   }
   if (dx > 0)
     clearScreenBuffer(screenBuffer, x1, y1, x1 + dx - 1, y2, T_NORMAL, ' ');
@@ -2235,37 +2620,122 @@ static void moveScreenBuffer(ScreenBuffer *screenBuffer,
 
 
 static ScreenBuffer *allocateScreenBuffer(int width, int height) {
-  unsigned short *attributesPtr;
-  char           *linePtr;
+  Cell           *cellPtr;
   int            i;
 
-  size_t attributesMemorySize   = width * height * sizeof(unsigned short);
-  size_t screenMemorySize       = width * height * sizeof(char);
-  size_t lineMemorySize         = sizeof(char *) * height;
+  size_t cellMemorySize         = width * height * sizeof(Cell);
+  size_t lineMemorySize         = sizeof(Cell *) * height;
   ScreenBuffer *screenBuffer    = malloc(sizeof(ScreenBuffer) +
-                                       screenMemorySize + attributesMemorySize+
-                                       2*lineMemorySize);
-  screenBuffer->attributes      = (unsigned short **)&screenBuffer[1];
-  screenBuffer->lineBuffer      = (char **)&screenBuffer->attributes[height];
+                                         lineMemorySize + cellMemorySize);
+  screenBuffer->cells           = (Cell **)&screenBuffer[1];
   screenBuffer->cursorX         =
   screenBuffer->cursorY         = 0;
   screenBuffer->maximumWidth    = width;
   screenBuffer->maximumHeight   = height;
-  for (attributesPtr = (unsigned short *)&screenBuffer->lineBuffer[height],i=0;
+  for (cellPtr = (Cell *)&screenBuffer->cells[height], i = 0;
        i < height;
-       attributesPtr += width, i++) {
-    screenBuffer->attributes[i] = attributesPtr;
+       cellPtr += width, i++) {
+    screenBuffer->cells[i]      = cellPtr;
   }
-  for (linePtr = (char *)attributesPtr, i = 0;
-       i < height;
-       linePtr += width, i++) {
-    screenBuffer->lineBuffer[i] = linePtr;
+  fillCells(screenBuffer->cells[0], BLANK_CELL, width * height);
+  screenBuffer->memory          = screenBuffer->cells;
+  screenBuffer->viewportY       = 0;
+  screenBuffer->spanLists       = NULL;
+  if (useAttributeSpans) {
+    screenBuffer->spanLists     = malloc(height * sizeof(SpanList));
+    for (i = 0; i < height; i++) {
+      SpanList *spanList        = &screenBuffer->spanLists[i];
+      spanList->size            = 4;
+      spanList->count           = 1;
+      spanList->spans           = malloc(spanList->size *
+                                         sizeof(AttributeSpan));
+      spanList->spans[0].start  = 0;
+      spanList->spans[0].attributes
+                                = T_NORMAL;
+    }
   }
-  _clearScreenBuffer(screenBuffer, 0, 0, width-1, height-1, T_NORMAL, ' ');
+  screenBuffer->spanMemory      = screenBuffer->spanLists;
   return(screenBuffer);
 }
 
 
+static void freeScreenBuffer(ScreenBuffer *screenBuffer) {
+  if (screenBuffer->spanMemory) {
+    int i;
+
+    for (i = 0; i < screenBuffer->maximumHeight; i++)
+      free(screenBuffer->spanMemory[i].spans);
+    free(screenBuffer->spanMemory);
+  }
+  free(screenBuffer);
+  return;
+}
+
+
+static int pageRows(void) {
+  /* Returns the number of rows of page memory for the current page          */
+  int rows                      = pageFactor[currentPage] * logicalHeight();
+
+  return(rows < currentBuffer->maximumHeight
+         ? rows : currentBuffer->maximumHeight);
+}
+
+
+static void clearMemoryRow(ScreenBuffer *screenBuffer, int y) {
+  fillCells(screenBuffer->memory[y], BLANK_CELL, screenBuffer->maximumWidth);
+  if (screenBuffer->spanMemory) {
+    screenBuffer->spanMemory[y].count               = 1;
+    screenBuffer->spanMemory[y].spans[0].start      = 0;
+    screenBuffer->spanMemory[y].spans[0].attributes = T_NORMAL;
+  }
+  return;
+}
+
+
+static void reverseMemoryRows(ScreenBuffer *screenBuffer, int y1, int y2) {
+  for (; y1 < y2; y1++, y2--) {
+    Cell *row                   = screenBuffer->memory[y1];
+    screenBuffer->memory[y1]    = screenBuffer->memory[y2];
+    screenBuffer->memory[y2]    = row;
+    if (screenBuffer->spanMemory) {
+      SpanList spanList         = screenBuffer->spanMemory[y1];
+      screenBuffer->spanMemory[y1]
+                                = screenBuffer->spanMemory[y2];
+      screenBuffer->spanMemory[y2]
+                                = spanList;
+    }
+  }
+  return;
+}
+
+
+static void shiftMemoryRows(ScreenBuffer *screenBuffer, int rows, int n) {
+  /* Moves the first "rows" rows of page memory up (n > 0) or down (n < 0)   */
+  /* by rotating the row pointers, and blanks the rows that become free.     */
+  int y;
+
+  if (n > rows)
+    n                           = rows;
+  else if (n < -rows)
+    n                           = -rows;
+  if (n > 0) {
+    reverseMemoryRows(screenBuffer, 0, n - 1);
+    reverseMemoryRows(screenBuffer, n, rows - 1);
+    reverseMemoryRows(screenBuffer, 0, rows - 1);
+    for (y = rows - n; y < rows; y++)
+      clearMemoryRow(screenBuffer, y);
+  } else if (n < 0) {
+    reverseMemoryRows(screenBuffer, 0, rows + n - 1);
+    reverseMemoryRows(screenBuffer, rows + n, rows - 1);
+    reverseMemoryRows(screenBuffer, 0, rows - 1);
+    for (y = 0; y < -n; y++)
+      clearMemoryRow(screenBuffer, y);
+  }
+  setViewport(screenBuffer, screenBuffer->viewportY);
+  return;
+}
+
+
 static ScreenBuffer *adjustScreenBuffer(ScreenBuffer *screenBuffer,
                                         int width, int height) {
   needsClearingBuffers          = 1;
@@ -2277,11 +2747,13 @@ static ScreenBuffer *adjustScreenBuffer(ScreenBuffer *screenBuffer,
     screenBuffer                = allocateScreenBuffer(width, height);
   else if (width  > screenBuffer->maximumWidth ||
            height > screenBuffer->maximumHeight) {
-    /* Screen buffers only ever grow in size, they never shrink back to      */
-    /* smaller dimensions even if the user shrunk the screen size. This      */
-    /* doesn't waste much space, and allows for reducing the number of times */
-    /* that we need to reallocate memory; also, it allows us to redraw old   */
-    /* screen content if the screen size grows back.                         */
+    /* Screen buffers only grow in size here, they do not immediately shrink */
+    /* back to smaller dimensions if the user shrunk the screen size. This   */
+    /* allows for reducing the number of times that we need to reallocate    */
+    /* memory while the user is still resizing the window; also, it allows   */
+    /* us to redraw old screen content if the screen size grows back. Once   */
+    /* the session has been idle for a while, compactScreenBuffers() gives   */
+    /* the excess memory back.                                               */
     int          i;
     int          tmpWidth       = width > screenBuffer->maximumWidth
                                   ? width : screenBuffer->maximumWidth;
@@ -2293,12 +2765,12 @@ static ScreenBuffer *adjustScreenBuffer(ScreenBuffer *screenBuffer,
     tmpWidth                    = screenBuffer->maximumWidth;
     tmpHeight                   = screenBuffer->maximumHeight;
     for (i = 0; i < tmpHeight; i++) {
-      memcpy(newBuffer->attributes[i], screenBuffer->attributes[i],
-             tmpWidth * sizeof(unsigned short));
-      memcpy(newBuffer->lineBuffer[i], screenBuffer->lineBuffer[i],
-             tmpWidth * sizeof(char));
+      memcpy(newBuffer->memory[i], screenBuffer->memory[i],
+             tmpWidth * sizeof(Cell));
     }
-    free(screenBuffer);
+    refreshAttributeSpans(newBuffer, 0, tmpHeight - 1);
+    setViewport(newBuffer, screenBuffer->viewportY);
+    freeScreenBuffer(screenBuffer);
     screenBuffer                = newBuffer;
   }
   if (screenBuffer->cursorX >= width)
@@ -2309,75 +2781,641 @@ static ScreenBuffer *adjustScreenBuffer(ScreenBuffer *screenBuffer,
 }
 
 
-static void displayCurrentScreenBuffer(void) {
+static void adjustScreenBuffers(int width, int height) {
+  /* Pages other than the current one are only allocated once the            */
+  /* application selects them for the first time.                            */
+  int i;
+
+  for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++)
+    if (screenBuffer[i] || i == currentPage) {
+      ScreenBuffer *page            = adjustScreenBuffer(screenBuffer[i],
+                                                         width,
+                                                         pageFactor[i]*height);
+
+      /* Keep the viewport and the cursor inside of the page memory          */
+      if (page->viewportY > (pageFactor[i] - 1) * height)
+        setViewport(page, (pageFactor[i] - 1) * height);
+      if (page->cursorY >= height)
+        page->cursorY               = height - 1;
+      screenBuffer[i]               = page;
+    }
+  currentBuffer                     = screenBuffer[currentPage];
+  return;
+}
+
+
+static ScreenBuffer *compactScreenBuffer(ScreenBuffer *screenBuffer,
+                                         int width, int height) {
+  /* Releases any memory that a screen buffer holds in excess of the given   */
+  /* dimensions.                                                             */
+  if (screenBuffer &&
+      (screenBuffer->maximumWidth  > width ||
+       screenBuffer->maximumHeight > height)) {
+    ScreenBuffer *newBuffer         = allocateScreenBuffer(width, height);
+    int          i;
+
+    for (i = 0; i < height && i < screenBuffer->maximumHeight; i++)
+      memcpy(newBuffer->memory[i], screenBuffer->memory[i],
+             (width < screenBuffer->maximumWidth
+              ? width : screenBuffer->maximumWidth) * sizeof(Cell));
+    refreshAttributeSpans(newBuffer, 0, height - 1);
+    setViewport(newBuffer, screenBuffer->viewportY + screenHeight <= height
+                           ? screenBuffer->viewportY : 0);
+    newBuffer->cursorX              = screenBuffer->cursorX < width
+                                      ? screenBuffer->cursorX : width - 1;
+    newBuffer->cursorY              = screenBuffer->cursorY < height
+                                      ? screenBuffer->cursorY : height - 1;
+    freeScreenBuffer(screenBuffer);
+    screenBuffer                    = newBuffer;
+  }
+  return(screenBuffer);
+}
+
+
+static void compactScreenBuffers(void) {
+  int i;
+
+  for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++)
+    screenBuffer[i]                 = compactScreenBuffer(screenBuffer[i],
+                                                          screenWidth,
+                                                          pageFactor[i] *
+                                                          screenHeight);
+  currentBuffer                     = screenBuffer[currentPage];
+  if (historyView) {
+    freeScreenBuffer(historyView);
+    historyView                     = NULL;
+  }
+  compactionTime                    = 0;
+  return;
+}
+
+
+static int emitHistorySequence(unsigned char *dst, int op,
+                               const unsigned char *literals, int count,
+                               int offset, int matchLength) {
+  int token                         = (count < 15 ? count : 15) << 4;
+  int i;
+
+  if (matchLength)
+    token                          |= matchLength - 4 < 15
+                                      ? matchLength - 4 : 15;
+  dst[op++]                         = token;
+  if (count >= 15) {
+    for (i = count - 15; i >= 255; i -= 255)
+      dst[op++]                     = 255;
+    dst[op++]                       = i;
+  }
+  memcpy(dst + op, literals, count);
+  op                               += count;
+  if (matchLength) {
+    dst[op++]                       = offset & 0xFF;
+    dst[op++]                       = offset >> 8;
+    if (matchLength - 4 >= 15) {
+      for (i = matchLength - 4 - 15; i >= 255; i -= 255)
+        dst[op++]                   = 255;
+      dst[op++]                     = i;
+    }
+  }
+  return(op);
+}
+
+
+static int compressHistory(const unsigned char *src, int length,
+                           unsigned char *dst) {
+  /* A minimal LZ77 compressor in the spirit of LZ4. Each sequence consists  */
+  /* of a token byte, an optional literal run, and a back reference into     */
+  /* the data that has already been decoded. The output buffer must have     */
+  /* room for at least "length + length/255 + 16" bytes.                     */
+  unsigned short table[4096];
+  int            ip                 = 0;
+  int            anchor             = 0;
+  int            op                 = 0;
+
+  memset(table, 0xFF, sizeof(table));
+  while (ip + 4 <= length) {
+    unsigned int key                = ((unsigned int)src[ip]           |
+                                       ((unsigned int)src[ip + 1] << 8)  |
+                                       ((unsigned int)src[ip + 2] << 16) |
+                                       ((unsigned int)src[ip + 3] << 24))
+                                      * 2654435761U >> 20;
+    int          candidate          = table[key];
+
+    table[key]                      = ip;
+    if (candidate != 0xFFFF && !memcmp(src + candidate, src + ip, 4)) {
+      int matchLength               = 4;
+
+      while (ip + matchLength < length &&
+             src[candidate + matchLength] == src[ip + matchLength])
+        matchLength++;
+      op                            = emitHistorySequence(dst, op,
+                                                          src + anchor,
+                                                          ip - anchor,
+                                                          ip - candidate,
+                                                          matchLength);
+      ip                           += matchLength;
+      anchor                        = ip;
+    } else
+      ip++;
+  }
+  return(emitHistorySequence(dst, op, src + anchor, length - anchor, 0, 0));
+}
+
+
+static int decompressHistory(const unsigned char *src, int length,
+                             unsigned char *dst) {
+  const unsigned char *end          = src + length;
+  int                 op            = 0;
+
+  while (src < end) {
+    int token                       = *src++;
+    int count                       = token >> 4;
+    int offset;
+
+    if (count == 15)
+      do {
+        count                      += *src;
+      } while (*src++ == 255);
+    memcpy(dst + op, src, count);
+    src                            += count;
+    op                             += count;
+    if (src >= end)
+      break;
+    offset                          = src[0] | (src[1] << 8);
+    src                            += 2;
+    count                           = (token & 15) + 4;
+    if ((token & 15) == 15)
+      do {
+        count                      += *src;
+      } while (*src++ == 255);
+    for (; count-- > 0; op++)
+      dst[op]                       = dst[op - offset];
+  }
+  return(op);
+}
+
+
+static int encodeHistoryLine(const Cell *cells, int width,
+                             unsigned char *buffer) {
+  /* Lines are stored as a sequence of attribute runs. Each run consists of  */
+  /* two bytes of attributes, a one byte character count, and the actual     */
+  /* characters. Trailing blanks are dropped.                                */
+  int length                        = 0;
+  int x, run;
+
+  while (width > 0 && cells[width - 1] == BLANK_CELL)
+    width--;
+  for (x = 0; x < width; ) {
+    run                             = attributeRunLength(cells + x,
+                                                         width - x);
+    if (run > 255)
+      run                           = 255;
+    buffer[length++]                = CELL_ATTRIBUTES(cells[x]) >> 8;
+    buffer[length++]                = CELL_ATTRIBUTES(cells[x]) & 0xFF;
+    buffer[length++]                = run;
+    for (; run-- > 0; x++)
+      buffer[length++]              = CELL_CHARACTER(cells[x]);
+  }
+  return(length);
+}
+
+
+static void decodeHistoryLine(const unsigned char *data, int length,
+                              Cell *cells, int width) {
+  const unsigned char *end          = data + length;
+  int                 x             = 0;
+
+  fillCells(cells, BLANK_CELL, width);
+  while (data < end) {
+    int attributes                  = (data[0] << 8) | data[1];
+    int run                         = data[2];
+
+    for (data += 3; run-- > 0; data++, x++)
+      if (x < width)
+        cells[x]                    = CELL(attributes, *data);
+  }
+  return;
+}
+
+
+static const unsigned char *historyLineData(HistoryLine *line) {
+  HistoryBlock *block               = line->block;
+
+  if (!block->isCompressed)
+    return(block->data + line->offset);
+  if (cachedHistoryBlock != block) {
+    decompressHistory(block->data, block->length, cachedHistoryData);
+    cachedHistoryBlock              = block;
+  }
+  return(cachedHistoryData + line->offset);
+}
+
+
+static void closeHistoryBlock(void) {
+  if (openHistoryBlock) {
+    HistoryBlock  *block            = openHistoryBlock;
+    unsigned char buffer[sizeof(cachedHistoryData) +
+                         sizeof(cachedHistoryData)/255 + 16];
+    int           length            = compressHistory(block->data,
+                                                      block->length, buffer);
+
+    free(block->data);
+    block->data                     = memcpy(malloc(length), buffer, length);
+    historyMemory                  += length - sizeof(cachedHistoryData);
+    block->rawLength                = block->length;
+    block->length                   = length;
+    block->isCompressed             = 1;
+    openHistoryBlock                = NULL;
+  }
+  return;
+}
+
+
+static void dropOldestHistoryLine(void) {
+  HistoryLine *line                 = historyLines[historyStart];
+
+  historyStart                      = (historyStart + 1) % historySize;
+  historyCount--;
+  if (--line->references == 0) {
+    HistoryBlock *block             = line->block;
+    HistoryLine  **linePtr;
+
+    for (linePtr = &historyHash[line->hash % 4096];
+         *linePtr != line;
+         linePtr = &(*linePtr)->next);
+    *linePtr                        = line->next;
+    free(line);
+    historyMemory                  -= sizeof(HistoryLine);
+    if (--block->references == 0) {
+      if (block == openHistoryBlock) {
+        openHistoryBlock            = NULL;
+        historyMemory              -= sizeof(cachedHistoryData);
+      } else
+        historyMemory              -= block->length;
+      if (block == cachedHistoryBlock)
+        cachedHistoryBlock          = NULL;
+      free(block->data);
+      free(block);
+      historyMemory                -= sizeof(HistoryBlock);
+    }
+  }
+  return;
+}
+
+
+static void addHistoryLine(const Cell *cells, int width) {
+  unsigned char buffer[sizeof(cachedHistoryData)];
+  HistoryLine   *line;
+  unsigned int  hash                = 2166136261U;
+  int           length, i;
+
+  if (width > sizeof(buffer) / 4)
+    width                           = sizeof(buffer) / 4;
+  length                            = encodeHistoryLine(cells, width,
+                                                        buffer);
+  for (i = 0; i < length; i++)
+    hash                            = (hash ^ buffer[i]) * 16777619U;
+
+  /* Check whether the same line has been seen before                        */
+  for (line = historyHash[hash % 4096]; line; line = line->next)
+    if (line->hash == hash && line->length == length &&
+        !memcmp(historyLineData(line), buffer, length))
+      break;
+  if (!line) {
+    if (openHistoryBlock &&
+        openHistoryBlock->length + length > sizeof(cachedHistoryData))
+      closeHistoryBlock();
+    if (!openHistoryBlock) {
+      openHistoryBlock              = calloc(sizeof(HistoryBlock), 1);
+      openHistoryBlock->data        = malloc(sizeof(cachedHistoryData));
+      historyMemory                += sizeof(HistoryBlock) +
+                                      sizeof(cachedHistoryData);
+    }
+    line                            = malloc(sizeof(HistoryLine));
+    line->block                     = openHistoryBlock;
+    line->hash                      = hash;
+    line->offset                    = openHistoryBlock->length;
+    line->length                    = length;
+    line->references                = 0;
+    line->next                      = historyHash[hash % 4096];
+    historyHash[hash % 4096]        = line;
+    memcpy(openHistoryBlock->data + openHistoryBlock->length, buffer, length);
+    openHistoryBlock->length       += length;
+    openHistoryBlock->references++;
+    historyMemory                  += sizeof(HistoryLine);
+  }
+  line->references++;
+
+  /* Append the line to the ring buffer of history entries                   */
+  if (historyCount == historySize) {
+    int         newSize             = historySize ? 2*historySize : 256;
+    HistoryLine **newLines          = malloc(newSize * sizeof(HistoryLine *));
+
+    for (i = 0; i < historyCount; i++)
+      newLines[i]                   = historyLines[(historyStart + i) %
+                                                   historySize];
+    free(historyLines);
+    historyMemory                  += (newSize - historySize) *
+                                      sizeof(HistoryLine *);
+    historyLines                    = newLines;
+    historySize                     = newSize;
+    historyStart                    = 0;
+  }
+  historyLines[(historyStart + historyCount++) % historySize]
+                                    = line;
+
+  /* Enforce the memory limit by discarding the oldest lines                 */
+  while (historyMemory > historyLimit && historyCount > 0)
+    dropOldestHistoryLine();
+  return;
+}
+
+
+static void saveHistory(int y1, int y2) {
+  /* Remembers the rows y1..y2 of the page 0 memory before they scroll off   */
+  /* the top of the page.                                                    */
+  if (historyLimit > 0 && currentBuffer == screenBuffer[0]) {
+    int y;
+
+    if (y2 >= pageRows())
+      y2                            = pageRows() - 1;
+    for (y = y1; y <= y2; y++)
+      addHistoryLine(currentBuffer->memory[y], logicalWidth());
+  }
+  return;
+}
+
+
+static void drawCell(Cell cell) {
+  /* Outputs a single cell from the screen buffer at the current position    */
+  int attributes             = CELL_ATTRIBUTES(cell);
+  int oldNormalAttributes    = normalAttributes;
+  int oldProtectedAttributes = protectedAttributes;
+  int oldProtected           = protected;
+
+  protected                  = !!(attributes & T_PROTECTED);
+  normalAttributes           =
+  protectedAttributes        = attributes & T_ALL;
+  if (attributes & T_GRAPHICS)
+    putGraphics(CELL_CHARACTER(cell));
+  else
+    putConsole(CELL_CHARACTER(cell));
+  currentBuffer->cursorX++;
+  normalAttributes           = oldNormalAttributes;
+  protectedAttributes        = oldProtectedAttributes;
+  protected                  = oldProtected;
+  return;
+}
+
+
+static int canFillCorner(void) {
+  return(!auto_right_margin ||
+         (enter_am_mode && strcmp(enter_am_mode, "@") &&
+          exit_am_mode && strcmp(exit_am_mode, "@")) ||
+         (screenWidth > 1 && !insertMode &&
+          ((enter_insert_mode && strcmp(enter_insert_mode, "@") &&
+            exit_insert_mode && strcmp(exit_insert_mode, "@")) ||
+           (insert_character && strcmp(insert_character, "@")) ||
+           (parm_ich && strcmp(parm_ich, "@")))));
+}
+
+
+static int fillCorner(void) {
+  /* Outputting the very last character on the screen is difficult, because  */
+  /* terminals with auto margins scroll the screen. Either turn off the auto */
+  /* margins for a moment, or print the character one position to the left   */
+  /* and then insert the character that belongs there in front of it.        */
+  /* Returns zero, if the terminal cannot do either.                         */
+  int  x                     = screenWidth - 1;
+  int  y                     = screenHeight - 1;
+  Cell *cellPtr              = currentBuffer->cells[y];
+  char buffer[1024];
+
+  if (!canFillCorner())
+    return(0);
+  if (!auto_right_margin) {
+    gotoXY(x, y);
+    drawCell(cellPtr[x]);
+  } else if (enter_am_mode && strcmp(enter_am_mode, "@") &&
+             exit_am_mode && strcmp(exit_am_mode, "@")) {
+    gotoXY(x, y);
+    putCapability(exit_am_mode);
+    drawCell(cellPtr[x]);
+    putCapability(enter_am_mode);
+  } else {
+    Cell cell                = cellPtr[x-1];
+
+    gotoXY(x - 1, y);
+    drawCell(cellPtr[x]);
+    gotoXY(x - 1, y);
+    if (enter_insert_mode && strcmp(enter_insert_mode, "@") &&
+        exit_insert_mode && strcmp(exit_insert_mode, "@")) {
+      putCapability(enter_insert_mode);
+      drawCell(cell);
+      putCapability(exit_insert_mode);
+    } else {
+      if (insert_character && strcmp(insert_character, "@"))
+        putCapability(insert_character);
+      else
+        putCapability(expandParm(buffer, parm_ich, 1));
+      drawCell(cell);
+    }
+  }
+  currentBuffer->cursorX     = x;
+  return(1);
+}
+
+
+static void displayRows(int y1, int y2) {
   int x, y, lastAttributes      = -1;
   int oldX                      = currentBuffer->cursorX;
   int oldY                      = currentBuffer->cursorY;
   int oldNormalAttributes       = normalAttributes;
   int oldProtectedAttributes    = protectedAttributes;
   int oldProtected              = protected;
-  int oldCursorVisibility       = cursorIsHidden;
+  int corner, lastRow, width, end, i;
+  char buffer[1024];
 
-  showCursor(0);
-  for (y = screenHeight; y-- > 0; ) {
-    unsigned short*attributesPtr= currentBuffer->attributes[y];
-    char          *linePtr      = currentBuffer->lineBuffer[y];
-    if (y == screenHeight-1 && y > 0) {
+  if (y2 >= screenHeight)
+    y2                          = screenHeight - 1;
+  corner                        = y2 == screenHeight-1 && canFillCorner();
+  lastRow                       = y2 == screenHeight-1 && y2 > 0 && !corner;
+  if (lastRow && y1 > y2-1)
+    y1                          = y2-1;
+  setHostCursor(0);
+  for (i = y1; i <= y2; i++) {
+    /* Draw from the top, so that the cursor wraps from one line to the next */
+    /* on its own. Only the work-around for the last line needs to start at  */
+    /* the bottom.                                                           */
+    Cell *cellPtr;
+
+    y                           = lastRow ? y2 + y1 - i : i;
+    cellPtr                     = currentBuffer->cells[y];
+    width                       = y == screenHeight-1 && corner
+                                  ? screenWidth - 1 : screenWidth;
+    if (y == screenHeight-1 && lastRow) {
       /* Outputting the very last character on the screen is difficult. We   */
       /* work around this problem by printing the last line one line too     */
       /* high and then scrolling it into place.                              */
       gotoXYforce(0, y-1);
+      flushCursor();
       currentBuffer->cursorY    = y;
-    } else
+    } else if (i == y1 || lastRow)
       gotoXYforce(0, y);
-    for (x = 0; x < screenWidth; x++) {
-      unsigned short attributes = *attributesPtr++;
-      char character            = *linePtr++;
+    else
+      gotoXY(0, y);
+
+    /* Erasing the trailing blanks can be faster than overwriting them, even */
+    /* though the cursor then has to be moved to the next line explicitly.   */
+    end                         = width;
+    if (width == screenWidth && y < screenHeight-1 && !lastRow &&
+        clr_eol && strcmp(clr_eol, "@")) {
+      while (end > 0 && cellPtr[end-1] == BLANK_CELL)
+        end--;
+      if (end == width || !expandParm2(buffer, cursor_address, y+1, 0) ||
+          capabilityCost(clr_eol) + capabilityCost(buffer) >= width - end)
+        end                     = width;
+    }
+    for (x = 0; x < end; ) {
+      /* Process the line one attribute run at a time, so that attributes    */
+      /* only need to be examined when they actually change.                 */
+      int run                   = attributeRun(currentBuffer, x, y,
+                                               end - x);
+      int attributes            = CELL_ATTRIBUTES(cellPtr[x]);
       if (attributes != lastAttributes) {
         protected               = !!(attributes & T_PROTECTED);
         normalAttributes        =
         protectedAttributes     = attributes & T_ALL;
-        updateAttributes();
         lastAttributes          = attributes;
       }
-      if (attributes & T_GRAPHICS)
-        putGraphics(character);
-      else
-        putConsole(character);
-      currentBuffer->cursorX++;
+      for (; run-- > 0; x++) {
+        char character          = CELL_CHARACTER(cellPtr[x]);
+        if (attributes & T_GRAPHICS)
+          putGraphics(character);
+        else
+          putConsole(character);
+        currentBuffer->cursorX++;
+      }
     }
-    if (y == screenHeight-1 && y > 0) {
+    if (end < width) {
+      lastAttributes            = CELL_ATTRIBUTES(BLANK_CELL);
+      protected                 = 0;
+      normalAttributes          =
+      protectedAttributes       = lastAttributes & T_ALL;
+      putCapability(clr_eol);
+    } else if (width < screenWidth)
+      fillCorner();
+    else if (y < screenHeight-1 && !lastRow)
+      wrapCursor();
+    if (y == screenHeight-1 && lastRow) {
       gotoXYforce(0, y-1);
       if (insert_line && strcmp(insert_line, "@"))
         putCapability(insert_line);
-      else {
-        char buffer[1024];
-        
+      else
         putCapability(expandParm(buffer, parm_insert_line, 1));
-      }
     }
   }
   gotoXYforce(oldX, oldY);
   normalAttributes              = oldNormalAttributes;
   protectedAttributes           = oldProtectedAttributes;
   protected                     = oldProtected;
-  updateAttributes();
-  showCursor(!oldCursorVisibility);
+  setHostCursor(!cursorIsHidden && !cursorBurst);
+  return;
+}
+
+
+static void displayCurrentScreenBuffer(void) {
+  displayRows(0, screenHeight - 1);
   flushConsole();
   return;
 }
 
 
-static void flushConsole(void) {
+static void _flushConsole(void) {
   if (outputBufferLength) {
+    if (checkpointTrial) {
+      /* Output that is generated on trial never gets sent to the terminal.  */
+      /* If it does not fit into the buffer, it is too long anyway.          */
+      checkpointTrial    = -1;
+      outputBufferLength = checkpointLength;
+      return;
+    }
+    checkpointLength     = -1;
     write(1, outputBuffer, outputBufferLength);
-    outputBufferLength = 0;
+    outputBufferLength   = 0;
   }
   return;
 }
 
 
-static void writeConsole(const char *buffer, int len) {
+static void flushConsole(void) {
+  flushCursor();
+  _flushConsole();
+  return;
+}
+
+
+static int keyboardPending(void) {
+  struct pollfd descriptor;
+
+  descriptor.fd         = 0;
+  descriptor.events     = POLLIN;
+  return(poll(&descriptor, 1, 0) > 0);
+}
+
+
+static void drainConsole(void) {
+  /* A slow terminal can take a long time to accept a big update. Hand it    */
+  /* over in pieces, and stop as soon as the user starts typing. Whatever is */
+  /* left over gets sent on the next pass through the main loop.             */
+  struct pollfd descriptors[2];
+
+  if (!showPredictedCursor())
+    flushCursor();
+  checkpointLength      = -1;
+  descriptors[0].fd     = 0;
+  descriptors[0].events = POLLIN;
+  descriptors[1].fd     = 1;
+  descriptors[1].events = POLLOUT;
+  while (outputBufferLength > 0) {
+    int count           = outputBufferLength;
+
+    if (count > 1024)
+      count             = 1024;
+    if (poll(descriptors, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+    } else if (descriptors[0].revents) {
+      break;
+    }
+    if ((count          = write(1, outputBuffer, count)) <= 0) {
+      if (count < 0 && errno == EINTR)
+        continue;
+      outputBufferLength= 0;
+      break;
+    }
+    outputBufferLength -= count;
+    memmove(outputBuffer, outputBuffer + count, outputBufferLength);
+  }
+  return;
+}
+
+
+static int hostBacklog(void) {
+  /* Returns the number of bytes of output that the terminal has not         */
+  /* received yet; both in our own buffer and in the kernel's output queue.  */
+  int count                 = 0;
+
+#ifdef TIOCOUTQ
+  if (ioctl(1, TIOCOUTQ, &count) < 0)
+    count                   = 0;
+#endif
+  return(outputBufferLength + count);
+}
+
+
+static void writeConsole(const char *buffer, int len) {
+  if (skippingOutput)
+    return;
   while (len > 0) {
     int i               = sizeof(outputBuffer) - outputBufferLength;
     if (len < i)
@@ -2386,7 +3424,7 @@ static void writeConsole(const char *buffer, int len) {
     outputBufferLength += i;
     len                -= i;
     if (outputBufferLength == sizeof(outputBuffer))
-      flushConsole();
+      _flushConsole();
   }
   return;
 }
@@ -2426,6 +3464,12 @@ static int _putConsole(int ch) {
 
 
 static int putConsole(int ch) {
+  if (cursorWrapped && cursorPending && !blankCount && !scrollPending &&
+      currentBuffer->cursorX == 0 && currentBuffer->cursorY == cursorWrapY)
+    /* The terminal wraps the cursor to where we want it all by itself       */
+    cursorPending            = 0;
+  flushCursor();
+  updateAttributes();
   _putConsole(ch);
   logHostCharacter(0, ch);
   if (currentBuffer->cursorX >= 0 && currentBuffer->cursorY >= 0 &&
@@ -2433,18 +3477,16 @@ static int putConsole(int ch) {
       currentBuffer->cursorY < screenHeight) {
     unsigned short attributes = (unsigned short)currentAttributes;
 
-    currentBuffer->lineBuffer[currentBuffer->cursorY]
-                             [currentBuffer->cursorX] = ch & 0xFF;
     if (protected)
       attributes             |= T_PROTECTED;
-    currentBuffer->attributes[currentBuffer->cursorY]
-                             [currentBuffer->cursorX] = attributes;
+    putCell(currentBuffer, currentBuffer->cursorX, currentBuffer->cursorY,
+            CELL(attributes, ch));
   }
   return(ch);
 }
 
 
-static void putCapability(const char *capability) {
+static void _putCapability(const char *capability) {
   if (!capability || !strcmp(capability, "@"))
     failure(127, "Terminal has insufficient capabilities");
   logHostString(capability);
@@ -2453,126 +3495,182 @@ static void putCapability(const char *capability) {
 }
 
 
-static void gotoXY(int x, int y) {
+static void putCapability(const char *capability) {
+  /* Most capabilities depend on the position of the cursor, so any pending  */
+  /* cursor motion has to be sent to the terminal first. Erasing and         */
+  /* inserting might also depend on the current attributes.                  */
+  flushCursor();
+  updateAttributes();
+  _putCapability(capability);
+  return;
+}
+
+
+static int paddingCost(const char **capability) {
+  /* Parses a padding specification, and returns the number of pad           */
+  /* characters that tputs() sends for it at the current output speed.       */
+  const char *ptr            = *capability;
+  long       delay           = 0;
+  int        mandatory       = 0;
+
+  for (; *ptr >= '0' && *ptr <= '9'; ptr++)
+    delay                    = 10*delay + 10*(*ptr - '0');
+  if (*ptr == '.')
+    for (ptr++; *ptr >= '0' && *ptr <= '9'; ptr++)
+      if (ptr[-1] == '.')
+        delay               += *ptr - '0';
+  for (; *ptr == '*' || *ptr == '/'; ptr++)
+    if (*ptr == '/')
+      mandatory              = 1;
+  *capability                = ptr;
+  if (!mandatory && (xon_xoff || outputBaudRate < padding_baud_rate))
+    return(0);
+
+  /* The delay is in tenths of milliseconds, and each character takes ten    */
+  /* bit times.                                                              */
+  return((int)((delay * outputBaudRate + 99999) / 100000));
+}
+
+
+static int capabilityCost(const char *capability) {
+  /* Estimates how long it takes to send a capability to the terminal, in    */
+  /* character times. Unlike strlen(), this does not count the padding       */
+  /* specifications themselves, but the delays that they ask for. On a slow  */
+  /* serial line, a few milliseconds of padding can cost more than a longer  */
+  /* sequence without any padding.                                           */
+  const char *ptr            = capability;
+  int        cost            = 0;
+
+  if (!capability || !strcmp(capability, "@"))
+    return(0);
+#if !HAVE_TERM_H && !HAVE_NCURSES_TERM_H
+  /* Termcap entries have their padding at the start of the string           */
+  cost                       = paddingCost(&ptr);
+#endif
+  while (*ptr) {
+    if (ptr[0] == '$' && ptr[1] == '<') {
+      const char *end        = ptr + 2;
+      int        padding     = paddingCost(&end);
+
+      if (*end == '>') {
+        cost                += padding;
+        ptr                  = end + 1;
+        continue;
+      }
+    }
+    cost++;
+    ptr++;
+  }
+  return(cost);
+}
+
+
+static void moveCursor(int fromX, int fromY, int x, int y) {
   static const int  UNDEF      = 65536;
   static char       absolute[1024], horizontal[1024], vertical[1024];
   int               absoluteLength, horizontalLength, verticalLength;
   int               i;
   int               jumpedHome = 0;
-  int               width      = logicalWidth();
-  int               height     = logicalHeight();
-
-  if (x >= width)
-    x                          = width - 1;
-  if (x < 0)
-    x                          = 0;
-  if (y >= height)
-    y                          = height - 1;
-  if (y < 0)
-    y                          = 0;
 
   /* Directly move cursor by cursor addressing                               */
   if (expandParm2(absolute, cursor_address, y, x))
-    absoluteLength             = strlen(absolute);
+    absoluteLength             = capabilityCost(absolute);
   else
     absoluteLength             = UNDEF;
 
   /* Move cursor vertically                                                  */
-  if (y == currentBuffer->cursorY) {
+  if (y == fromY) {
     vertical[0]                = '\000';
     verticalLength             = 0;
   } else {
-    if (y < currentBuffer->cursorY) {
-      if (expandParm(vertical, parm_up_cursor, currentBuffer->cursorY - y))
-        verticalLength         = strlen(vertical);
+    if (y < fromY) {
+      if (expandParm(vertical, parm_up_cursor, fromY - y))
+        verticalLength         = capabilityCost(vertical);
       else
         verticalLength         = UNDEF;
       if (cursor_up && strcmp(cursor_up, "@") &&
-          (i = (currentBuffer->cursorY - y) *
-               strlen(cursor_up)) < verticalLength &&
+          (i = (fromY - y)*capabilityCost(cursor_up)) < verticalLength &&
           i < absoluteLength &&
-          i < sizeof(vertical)) {
+          (fromY - y)*strlen(cursor_up) < sizeof(vertical)) {
         vertical[0]            = '\000';
-        for (i = currentBuffer->cursorY - y; i--; )
+        for (i = fromY - y; i--; )
           strcat(vertical, cursor_up);
-        verticalLength         = strlen(vertical);
+        verticalLength         = capabilityCost(vertical);
       }
       if (cursor_home && strcmp(cursor_home, "@") &&
           cursor_down && strcmp(cursor_down, "@") &&
-          (i = strlen(cursor_home) +
-               strlen(cursor_down)*y) < verticalLength &&
+          (i = capabilityCost(cursor_home) +
+               capabilityCost(cursor_down)*y) < verticalLength &&
           i < absoluteLength &&
-          i < sizeof(vertical)) {
+          strlen(cursor_home) + strlen(cursor_down)*y < sizeof(vertical)) {
         strcpy(vertical, cursor_home);
         for (i = y; i--; )
           strcat(vertical, cursor_down);
-        verticalLength         = strlen(vertical);
-        currentBuffer->cursorX = 0;
+        verticalLength         = capabilityCost(vertical);
+        fromX                  = 0;
         jumpedHome             = 1;
       }
     } else {
-      if (expandParm(vertical, parm_down_cursor, y - currentBuffer->cursorY))
-        verticalLength         = strlen(vertical);
+      if (expandParm(vertical, parm_down_cursor, y - fromY))
+        verticalLength         = capabilityCost(vertical);
       else
         verticalLength         = UNDEF;
       if (cursor_down && strcmp(cursor_down, "@") &&
-          (i = (y - currentBuffer->cursorY) *
-               strlen(cursor_down)) < verticalLength &&
+          (i = (y - fromY)*capabilityCost(cursor_down)) < verticalLength &&
           i < absoluteLength &&
-          i < sizeof(vertical)) {
+          (y - fromY)*strlen(cursor_down) < sizeof(vertical)) {
         vertical[0]            = '\000';
-        for (i = y - currentBuffer->cursorY; i--; )
+        for (i = y - fromY; i--; )
           strcat(vertical, cursor_down);
-        verticalLength         = strlen(vertical);
+        verticalLength         = capabilityCost(vertical);
       }
     }
   }
 
   /* Move cursor horizontally                                                */
-  if (x == currentBuffer->cursorX) {
+  if (x == fromX) {
     horizontal[0]              = '\000';
     horizontalLength           = 0;
   } else {
-    if (x < currentBuffer->cursorX) {
+    if (x < fromX) {
       const char *cr           = carriage_return ? carriage_return : "\r";
 
-      if (expandParm(horizontal, parm_left_cursor, currentBuffer->cursorX - x))
-        horizontalLength       = strlen(horizontal);
+      if (expandParm(horizontal, parm_left_cursor, fromX - x))
+        horizontalLength       = capabilityCost(horizontal);
       else
         horizontalLength       = UNDEF;
       if (cursor_left && strcmp(cursor_left, "@") &&
-          (i = (currentBuffer->cursorX - x) *
-               strlen(cursor_left)) < horizontalLength &&
+          (i = (fromX - x)*capabilityCost(cursor_left)) < horizontalLength &&
           i < absoluteLength &&
-          i < sizeof(horizontal)) {
+          (fromX - x)*strlen(cursor_left) < sizeof(horizontal)) {
         horizontal[0]          = '\000';
-        for (i = currentBuffer->cursorX - x; i--; )
+        for (i = fromX - x; i--; )
           strcat(horizontal, cursor_left);
-        horizontalLength       = strlen(horizontal);
+        horizontalLength       = capabilityCost(horizontal);
       }
       if (cursor_right && strcmp(cursor_right, "@") &&
-          (i = strlen(cr) + strlen(cursor_right)*x) < horizontalLength &&
+          (i = capabilityCost(cr) +
+               capabilityCost(cursor_right)*x) < horizontalLength &&
           i < absoluteLength &&
-          i < sizeof(horizontal)) {
+          strlen(cr) + strlen(cursor_right)*x < sizeof(horizontal)) {
         strcpy(horizontal, cr);
         for (i = x; i--; )
           strcat(horizontal, cursor_right);
-        horizontalLength       = strlen(horizontal);
+        horizontalLength       = capabilityCost(horizontal);
       }
     } else {
-      if (expandParm(horizontal, parm_right_cursor,x - currentBuffer->cursorX))
-        horizontalLength       = strlen(horizontal);
+      if (expandParm(horizontal, parm_right_cursor, x - fromX))
+        horizontalLength       = capabilityCost(horizontal);
       else
         horizontalLength       = UNDEF;
       if (cursor_right && strcmp(cursor_right, "@") &&
-         (i = (x - currentBuffer->cursorX) *
-              strlen(cursor_right)) < horizontalLength &&
+          (i = (x - fromX)*capabilityCost(cursor_right)) < horizontalLength &&
           i < absoluteLength &&
-          i < sizeof(horizontal)) {
+          (x - fromX)*strlen(cursor_right) < sizeof(horizontal)) {
         horizontal[0]          = '\000';
-        for (i = x - currentBuffer->cursorX; i--; )
+        for (i = x - fromX; i--; )
           strcat(horizontal, cursor_right);
-        horizontalLength       = strlen(horizontal);
+        horizontalLength       = capabilityCost(horizontal);
       }
     }
   }
@@ -2580,37 +3678,238 @@ static void gotoXY(int x, int y) {
   /* Move cursor                                                             */
   if (absoluteLength < horizontalLength + verticalLength) {
     if (absoluteLength)
-      putCapability(absolute);
+      _putCapability(absolute);
   } else {
     if (jumpedHome) {
       if (verticalLength)
-        putCapability(vertical);
+        _putCapability(vertical);
       if (horizontalLength)
-        putCapability(horizontal);
+        _putCapability(horizontal);
     } else {
       if (horizontalLength)
-        putCapability(horizontal);
+        _putCapability(horizontal);
       if (verticalLength)
-        putCapability(vertical);
+        _putCapability(vertical);
     }
   }
 
-  currentBuffer->cursorX       = x;
-  currentBuffer->cursorY       = y;
-
   return;
 }
 
 
-static void gotoXYforce(int x, int y) {
-  int  width                 = logicalWidth();
-  int  height                = logicalHeight();
+static void forceCursor(int x, int y) {
   char buffer[1024];
 
   /* This function gets called when we do not know where the cursor currently*/
   /* is. So, the safest thing is to use absolute cursor addressing (if       */
   /* available) to force the cursor position. Otherwise, we fall back on     */
   /* relative positioning and keep our fingers crossed.                      */
+  if (expandParm2(buffer, cursor_address, y, x))
+    _putCapability(buffer);
+  else if (cursor_home && strcmp(cursor_home, "@")) {
+    _putCapability(cursor_home);
+    moveCursor(0, 0, x, y);
+  } else
+    moveCursor(hostCursorX, hostCursorY, x, y);
+  return;
+}
+
+
+static int rightMotionCost(int count) {
+  char buffer[1024];
+  int  cost                  = 65536;
+
+  if (cursor_right && strcmp(cursor_right, "@"))
+    cost                     = count * capabilityCost(cursor_right);
+  if (expandParm(buffer, parm_right_cursor, count) &&
+      capabilityCost(buffer) < cost)
+    cost                     = capabilityCost(buffer);
+  return(cost);
+}
+
+
+static void flushBlanks(void) {
+  /* Sends a deferred run of blanks to the terminal. Cells that already were */
+  /* blank do not need to be touched, the others get erased by whichever     */
+  /* method is the fastest to send.                                          */
+  int  end                   = blankX + blankCount;
+  int  y                     = blankY;
+  int  oldNormalAttributes   = normalAttributes;
+  int  oldProtected          = protected;
+  int  x, count, skip, i;
+  char buffer[1024];
+
+  if (!blankCount)
+    return;
+  flushScroll();
+  blankCount                 = 0;
+
+  /* Moving across a few blank cells can take longer than overwriting them.  */
+  if (blankDirtyStart >= blankDirtyEnd) {
+    if (rightMotionCost(end - blankX) >= end - blankX) {
+      blankDirtyStart        = blankX;
+      blankDirtyEnd          = end;
+    }
+  } else {
+    if (rightMotionCost(blankDirtyStart - blankX) >=
+        blankDirtyStart - blankX)
+      blankDirtyStart        = blankX;
+    if (rightMotionCost(end - blankDirtyEnd) >= end - blankDirtyEnd)
+      blankDirtyEnd          = end;
+  }
+  x                          = blankDirtyStart;
+  count                      = blankDirtyEnd - blankDirtyStart;
+  if (count <= 0)
+    return;
+
+  /* Move the cursor to the first cell that needs erasing                    */
+  cursorPending              = 0;
+  cursorWrapped              = 0;
+  if (cursorUnknown)
+    forceCursor(x, y);
+  else
+    moveCursor(hostCursorX, hostCursorY, x, y);
+  normalAttributes           = T_NORMAL;
+  protected                  = 0;
+  updateAttributes();
+  normalAttributes           = oldNormalAttributes;
+  protected                  = oldProtected;
+
+  /* Erasing does not move the cursor, so estimate the cost of moving it     */
+  /* across the erased cells afterwards.                                     */
+  skip                       = rightMotionCost(count);
+  cursorUnknown              = 0;
+  hostCursorX                = x;
+  hostCursorY                = y;
+  if (blankTail <= end &&
+      clr_eol && strcmp(clr_eol, "@") && capabilityCost(clr_eol)+skip < count)
+    _putCapability(clr_eol);
+  else if (expandParm(buffer, erase_chars, count) &&
+           capabilityCost(buffer) + skip < count)
+    _putCapability(buffer);
+  else {
+    for (i = count; i--; ) {
+      _putConsole(' ');
+      logHostCharacter(0, ' ');
+    }
+    if ((hostCursorX        += count) >= screenWidth) {
+      /* The terminal might, or might not, have wrapped the cursor           */
+      hostCursorX            = screenWidth - 1;
+      cursorUnknown          = 1;
+    }
+  }
+  cursorPending              = 1;
+  return;
+}
+
+
+static void flushScroll(void) {
+  /* Line feeds at the bottom of the screen scroll the screen buffer right   */
+  /* away, but the terminal only gets told once the next output depends on   */
+  /* it. Then, all of the pending lines scroll in a single operation.        */
+  int  count                 = scrollPending;
+  int  height                = logicalHeight();
+  int  oldNormalAttributes   = normalAttributes;
+  int  oldProtected          = protected;
+  int  x, y, i;
+  char buffer[1024];
+
+  if (!count)
+    return;
+  scrollPending              = 0;
+  x                          = currentBuffer->cursorX;
+  y                          = currentBuffer->cursorY;
+  if (count > scrollBottom - scrollTop + 1)
+    count                    = scrollBottom - scrollTop + 1;
+  if (!cursorPending) {
+    cursorUnknown            = 0;
+    hostCursorX              = x;
+    hostCursorY              = y;
+  }
+  cursorPending              = 1;
+  normalAttributes           = T_NORMAL;
+  protected                  = 0;
+  updateAttributes();
+  normalAttributes           = oldNormalAttributes;
+  protected                  = oldProtected;
+  if (scrollTop > 0 || scrollBottom < height - 1) {
+    /* Only a single text segment scrolls                                    */
+    _putCapability(expandParm2(buffer, change_scroll_region,
+                               scrollTop, scrollBottom));
+    forceCursor(x, scrollBottom);
+    if (count > 1 && expandParm(buffer, parm_index, count) &&
+        capabilityCost(buffer) < count * capabilityCost(scroll_forward))
+      _putCapability(buffer);
+    else
+      for (i = count; i--; )
+        _putCapability(scroll_forward);
+    _putCapability(expandParm2(buffer, change_scroll_region,
+                               0, screenHeight - 1));
+
+    /* Changing the scroll region can move the cursor anywhere               */
+    cursorUnknown            = 1;
+    return;
+  } else if (count >= height && !(parm_index && strcmp(parm_index, "@")) &&
+      clear_screen && strcmp(clear_screen, "@")) {
+    /* Everything scrolled off the screen                                    */
+    _putCapability(clear_screen);
+    x                        =
+    y                        = 0;
+  } else if (scroll_forward && strcmp(scroll_forward, "@")) {
+    if (cursorUnknown)
+      forceCursor(x, height - 1);
+    else
+      moveCursor(hostCursorX, hostCursorY, x, height - 1);
+    if (count > 1 && expandParm(buffer, parm_index, count) &&
+        capabilityCost(buffer) < count * capabilityCost(scroll_forward))
+      _putCapability(buffer);
+    else
+      for (i = count; i--; )
+        _putCapability(scroll_forward);
+    y                        = height - 1;
+  } else {
+    if (cursorUnknown)
+      forceCursor(0, 0);
+    else
+      moveCursor(hostCursorX, hostCursorY, 0, 0);
+    if (parm_delete_line && strcmp(parm_delete_line, "@"))
+      _putCapability(expandParm(buffer, parm_delete_line, count));
+    else
+      for (i = count; i--; )
+        _putCapability(delete_line);
+    x                        =
+    y                        = 0;
+  }
+  cursorUnknown              = 0;
+  hostCursorX                = x;
+  hostCursorY                = y;
+  return;
+}
+
+
+static void flushCursor(void) {
+  /* Cursor motion is deferred until the next output that depends on the     */
+  /* cursor position. This way, a burst of cursor movements only costs a     */
+  /* single (optimal) sequence of host motion commands.                      */
+  flushBlanks();
+  flushScroll();
+  cursorWrapped              = 0;
+  if (cursorPending) {
+    cursorPending            = 0;
+    if (cursorUnknown)
+      forceCursor(currentBuffer->cursorX, currentBuffer->cursorY);
+    else
+      moveCursor(hostCursorX, hostCursorY,
+                 currentBuffer->cursorX, currentBuffer->cursorY);
+  }
+  return;
+}
+
+
+static void setCursor(int x, int y, int force) {
+  int width                  = logicalWidth();
+  int height                 = logicalHeight();
+
   if (x >= width)
     x                        = width - 1;
   if (x < 0)
@@ -2619,18 +3918,222 @@ static void gotoXYforce(int x, int y) {
     y                        = height - 1;
   if (y < 0)
     y                        = 0;
-  if (expandParm2(buffer, cursor_address, y, x)) {
-    putCapability(buffer);
-    currentBuffer->cursorX   = x;
+  if (!cursorPending) {
+    /* Remember where the host cursor is now                                 */
+    cursorPending            = 1;
+    cursorUnknown            = 0;
+    hostCursorX              = currentBuffer->cursorX;
+    hostCursorY              = currentBuffer->cursorY;
+  }
+  cursorUnknown             |= force;
+  currentBuffer->cursorX     = x;
+  currentBuffer->cursorY     = y;
+  return;
+}
+
+
+static void gotoXY(int x, int y) {
+  setCursor(x, y, 0);
+  return;
+}
+
+
+static void gotoXYforce(int x, int y) {
+  setCursor(x, y, 1);
+  return;
+}
+
+
+static void wrapCursor(void) {
+  /* The terminal just printed a character into the last column. Move the    */
+  /* cursor to the beginning of the next line, keeping track of what the     */
+  /* terminal did on its own. Without auto margins, the cursor stays put.    */
+  /* With auto margins, it wraps right away, unless the terminal has the     */
+  /* eat-newline glitch. In that case, it is not clear where the cursor is,  */
+  /* but the next printable character is certain to end up on the next line. */
+  int y                      = currentBuffer->cursorY + 1;
+
+  if (blankCount)
+    /* The blank has not been sent yet. Flushing it tracks the cursor        */
+    gotoXY(0, y);
+  else if (logicalWidth() != screenWidth || y >= screenHeight || insertMode)
+    gotoXYforce(0, y);
+  else if (!auto_right_margin) {
+    currentBuffer->cursorX   = screenWidth - 1;
+    gotoXY(0, y);
+  } else if (!eat_newline_glitch) {
+    currentBuffer->cursorX   = 0;
     currentBuffer->cursorY   = y;
   } else {
-    if (cursor_home && strcmp(cursor_home, "@")) {
-      putCapability(cursor_home);
-      currentBuffer->cursorX = 0;
-      currentBuffer->cursorY = 0;
+    gotoXYforce(0, y);
+    cursorWrapped            = 1;
+    cursorWrapY              = y;
+  }
+  return;
+}
+
+
+static void putBlank(void) {
+  /* Blanks with normal attributes are not sent to the terminal right away.  */
+  /* Consecutive blanks on the same line get collected, so that they can     */
+  /* later be skipped or erased as a whole.                                  */
+  int  x                     = currentBuffer->cursorX;
+  int  y                     = currentBuffer->cursorY;
+  Cell *cellPtr;
+
+  if (insertMode || protected || desiredAttributes() != T_NORMAL ||
+      x < 0 || y < 0 || x >= screenWidth || y >= screenHeight) {
+    putConsole(' ');
+    return;
+  }
+  if (blankCount && (y != blankY || x != blankX + blankCount))
+    flushBlanks();
+  cellPtr                    = currentBuffer->cells[y];
+  if (!blankCount) {
+    if (!cursorPending) {
+      cursorPending          = 1;
+      cursorUnknown          = 0;
+      hostCursorX            = x;
+      hostCursorY            = y;
     }
-    gotoXY(x, y);
+    blankX                   = x;
+    blankY                   = y;
+    blankDirtyStart          = screenWidth;
+    blankDirtyEnd            = 0;
+
+    /* Find out where the trailing blanks of this line start                 */
+    for (blankTail = screenWidth;
+         blankTail > x && cellPtr[blankTail-1] == BLANK_CELL;
+         blankTail--);
   }
+  if (cellPtr[x] != BLANK_CELL) {
+    if (x < blankDirtyStart)
+      blankDirtyStart        = x;
+    blankDirtyEnd            = x + 1;
+    putCell(currentBuffer, x, y, BLANK_CELL);
+  }
+  blankCount++;
+  return;
+}
+
+
+static int isBlankRow(int y) {
+  Cell *cellPtr              = currentBuffer->cells[y];
+  int  x;
+
+  for (x = 0; x < screenWidth; x++)
+    if (cellPtr[x] != BLANK_CELL)
+      return(0);
+  return(1);
+}
+
+
+static void displayRevealedRows(int y1, int y2) {
+  /* Renders rows that scrolled into view from page memory. The host has     */
+  /* already blanked them, so blank rows at either end can be skipped.       */
+  while (y1 <= y2 && isBlankRow(y1))
+    y1++;
+  while (y2 >= y1 && isBlankRow(y2))
+    y2--;
+  if (y1 <= y2)
+    displayRows(y1, y2);
+  return;
+}
+
+
+static int isScreenSplit(void) {
+  return(segmentSplit > 0 && segmentSplit < logicalHeight());
+}
+
+
+static int segmentTop(void) {
+  /* Returns the first row of the active text segment.                       */
+  return(isScreenSplit() && activeSegment ? segmentSplit : 0);
+}
+
+
+static int segmentBottom(void) {
+  /* Returns the last row of the active text segment.                        */
+  return(isScreenSplit() && !activeSegment ? segmentSplit - 1
+                                           : logicalHeight() - 1);
+}
+
+
+static void selectSegment(int segment) {
+  /* Makes a different text segment active. Each segment remembers where its */
+  /* cursor was.                                                             */
+  if (segment != activeSegment) {
+    if (isScreenSplit()) {
+      int x                  = currentBuffer->cursorX;
+      int y                  = currentBuffer->cursorY;
+
+      gotoXY(segmentCursorX, segmentCursorY);
+      segmentCursorX         = x;
+      segmentCursorY         = y;
+    }
+    activeSegment            = segment;
+  }
+  return;
+}
+
+
+static void setSegmentSplit(int row) {
+  /* Divides the screen into two text segments, with the second one starting */
+  /* at the given row. A row of zero joins the segments again.               */
+  if (row <= 0 || row >= logicalHeight())
+    row                      = 0;
+  if (row == segmentSplit && !activeSegment)
+    return;
+  segmentSplit               = row;
+  activeSegment              = 0;
+  segmentCursorX             = 0;
+  segmentCursorY             = row;
+  gotoXY(0, 0);
+  return;
+}
+
+
+static void scrollSegment(int top, int bottom, int count) {
+  /* Scrolls the rows top..bottom up (count > 0) or down (count < 0), while  */
+  /* leaving the rest of the screen alone. On the terminal, this happens in  */
+  /* a scroll region; or, if there is none, by deleting and inserting lines. */
+  int  width                 = logicalWidth();
+  int  x                     = currentBuffer->cursorX;
+  int  y                     = currentBuffer->cursorY;
+  int  oldNormalAttributes   = normalAttributes;
+  int  oldProtected          = protected;
+  int  n                     = count > 0 ? count : -count;
+  int  i;
+  char buffer[1024];
+
+  if (n > bottom - top + 1)
+    n                        = bottom - top + 1;
+  if (n <= 0)
+    return;
+  if (count > 0) {
+    if (!top && !currentBuffer->viewportY)
+      saveHistory(0, n - 1);
+    moveScreenBuffer(currentBuffer, 0, top + n, width - 1, bottom, 0, -n);
+  } else
+    moveScreenBuffer(currentBuffer, 0, top, width - 1, bottom - n, 0, n);
+  normalAttributes           = T_NORMAL;
+  protected                  = 0;
+  if (bottom < screenHeight &&
+      change_scroll_region && strcmp(change_scroll_region, "@") &&
+      (count > 0 ? scroll_forward && strcmp(scroll_forward, "@")
+                 : scroll_reverse && strcmp(scroll_reverse, "@"))) {
+    putCapability(expandParm2(buffer, change_scroll_region, top, bottom));
+    gotoXYforce(0, count > 0 ? bottom : top);
+    for (i = n; i--; )
+      putCapability(count > 0 ? scroll_forward : scroll_reverse);
+    putCapability(expandParm2(buffer, change_scroll_region,
+                              0, screenHeight - 1));
+    gotoXYforce(x, y);
+  } else if (!shiftHostLines(top, bottom, count > 0 ? n : -n))
+    displayRows(top, bottom);
+  normalAttributes           = oldNormalAttributes;
+  protected                  = oldProtected;
+  gotoXY(x, y);
   return;
 }
 
@@ -2641,23 +4144,91 @@ static void gotoXYscroll(int x, int y) {
   char buffer[1024];
 
   if (x >= 0 && x < width) {
-    if (y < 0) {
-      moveScreenBuffer(currentBuffer,
-                       0, 0, width - 1, height - 1 + y,
-                       0, -y);
+    if (isScreenSplit()) {
+      /* Only the active text segment scrolls.                               */
+      int top                = segmentTop();
+      int bottom             = segmentBottom();
+
+      if (y < top && currentBuffer->cursorY >= top) {
+        scrollSegment(top, bottom, y - top);
+        y                    = top;
+      } else if (y > bottom && currentBuffer->cursorY <= bottom) {
+        if (bottom < screenHeight &&
+            change_scroll_region && strcmp(change_scroll_region, "@") &&
+            scroll_forward && strcmp(scroll_forward, "@")) {
+          /* Just like for the entire screen, consecutive line feeds at the  */
+          /* bottom of the segment are sent to the terminal all at once.     */
+          int count          = y - bottom;
+
+          if (count > bottom - top + 1)
+            count            = bottom - top + 1;
+          if (scrollPending && (scrollTop != top || scrollBottom != bottom))
+            flushScroll();
+          flushBlanks();
+          if (!top && !currentBuffer->viewportY)
+            saveHistory(0, count - 1);
+          moveScreenBuffer(currentBuffer, 0, top + count,
+                           width - 1, bottom, 0, -count);
+          scrollPending     += count;
+          scrollTop          = top;
+          scrollBottom       = bottom;
+        } else
+          scrollSegment(top, bottom, y - bottom);
+        y                    = bottom;
+      }
+      gotoXY(x, y);
+    } else if (y < 0) {
+      /* If the page memory extends above the viewport, then move the        */
+      /* viewport up and render the newly exposed rows from memory.          */
+      /* Otherwise, the content of the page scrolls down.                    */
+      int count              = -y;
+      int reveal             = currentBuffer->viewportY;
+
+      if (reveal > count)
+        reveal               = count;
+      clearExcessBuffers();
+      setViewport(currentBuffer, currentBuffer->viewportY - reveal);
+      shiftMemoryRows(currentBuffer, pageRows(), reveal - count);
       gotoXY(0, 0);
       if (parm_insert_line && strcmp(parm_insert_line, "@")) {
-        putCapability(expandParm(buffer, parm_insert_line, -y));
+        putCapability(expandParm(buffer, parm_insert_line, count));
       } else {
-        while (y++ < 0)
+        while (count-- > 0)
           putCapability(insert_line);
       }
+      displayRevealedRows(-y - reveal, -y - 1);
       gotoXY(x, 0);
     } else if (y >= height) {
-      moveScreenBuffer(currentBuffer,
-                       0, y - height + 1,
-                       width - 1, height - 1,
-                       0, height - y - 1);
+      /* If the page memory extends below the viewport, then move the        */
+      /* viewport down. Once it reaches the end of the page memory, the      */
+      /* content of the page scrolls up.                                     */
+      int count              = y - height + 1;
+      int reveal             = pageRows() - height - currentBuffer->viewportY;
+
+      if (reveal > count)
+        reveal               = count;
+      else if (reveal < 0)
+        reveal               = 0;
+      clearExcessBuffers();
+      if (!reveal) {
+        /* Nothing needs to be rendered from page memory. So, the terminal   */
+        /* can catch up with all consecutive line feeds at once.             */
+        if (scrollPending && (scrollTop || scrollBottom != height - 1))
+          flushScroll();
+        flushBlanks();
+        saveHistory(0, count - 1);
+        shiftMemoryRows(currentBuffer, pageRows(), count);
+        scrollPending       += count;
+        scrollTop            = 0;
+        scrollBottom         = height - 1;
+        gotoXY(x, height - 1);
+        return;
+      }
+      setViewport(currentBuffer, currentBuffer->viewportY + reveal);
+      if (count > reveal) {
+        saveHistory(0, count - reveal - 1);
+        shiftMemoryRows(currentBuffer, pageRows(), count - reveal);
+      }
       if (scroll_forward && strcmp(scroll_forward, "@")) {
         gotoXY(width - 1, height - 1);
         while (y-- >= height)
@@ -2672,6 +4243,7 @@ static void gotoXYscroll(int x, int y) {
             putCapability(delete_line);
         }
       }
+      displayRevealedRows(height - count, height - count + reveal - 1);
       gotoXYforce(x, height - 1);
     } else
       gotoXY(x, y);
@@ -2680,6 +4252,281 @@ static void gotoXYscroll(int x, int y) {
 }
 
 
+static unsigned int hashRow(const Cell *cellPtr, int width) {
+  unsigned int hash          = 2166136261u;
+
+  while (width--)
+    hash                     = (hash ^ *cellPtr++) * 16777619u;
+  return(hash);
+}
+
+
+static void setOutputCheckpoint(void) {
+  /* Remembers what the terminal shows right now, so that the output for the */
+  /* next batch of data from the application can be replaced by a cheaper    */
+  /* sequence of commands that results in the same screen.                   */
+  int y;
+
+  flushCursor();
+  if (checkpointSize < screenWidth * screenHeight) {
+    checkpointSize           = screenWidth * screenHeight;
+    checkpointCells          = realloc(checkpointCells,
+                                       checkpointSize * sizeof(Cell));
+  }
+  checkpointHashes           = realloc(checkpointHashes,
+                                       screenHeight * sizeof(unsigned int));
+  for (y = 0; y < screenHeight; y++) {
+    memcpy(checkpointCells + y*screenWidth, currentBuffer->cells[y],
+           screenWidth * sizeof(Cell));
+    checkpointHashes[y]      = hashRow(currentBuffer->cells[y], screenWidth);
+  }
+  checkpointLength           = outputBufferLength;
+  checkpointWidth            = screenWidth;
+  checkpointHeight           = screenHeight;
+  checkpointBuffer           = currentBuffer;
+  checkpointAttributes       = currentAttributes;
+  checkpointCursorHidden     = hostCursorIsHidden;
+  checkpointX                = currentBuffer->cursorX;
+  checkpointY                = currentBuffer->cursorY;
+  return;
+}
+
+
+static void commitOutput(void) {
+  /* The output since the last checkpoint has side effects that cannot be    */
+  /* recreated from the screen buffer; it has to be sent as is.              */
+  checkpointLength           = -1;
+  return;
+}
+
+
+static int shiftHostLines(int top, int bottom, int count) {
+  /* Scrolls the lines top..bottom up (count > 0) or down (count < 0) by     */
+  /* deleting and inserting lines.                                           */
+  int  oldNormalAttributes   = normalAttributes;
+  int  oldProtected          = protected;
+  int  height                = screenHeight;
+  int  i;
+  char buffer[1024];
+
+  if (!(delete_line && strcmp(delete_line, "@")) &&
+      !(parm_delete_line && strcmp(parm_delete_line, "@")))
+    return(0);
+  if (!(insert_line && strcmp(insert_line, "@")) &&
+      !(parm_insert_line && strcmp(parm_insert_line, "@")))
+    return(0);
+  normalAttributes           = T_NORMAL;
+  protected                  = 0;
+  for (i = 0; i < 2; i++) {
+    /* Delete lines at the top and insert them at the bottom of the region,  */
+    /* or the other way around.                                              */
+    int y                    = count > 0 ? (i ? bottom - count + 1 : top)
+                                         : (i ? bottom + 1 : top);
+    int n                    = count > 0 ? count : -count;
+    int delete               = (count > 0) == !i;
+
+    if (i && bottom >= height - 1)
+      break;
+    gotoXY(0, y);
+    if (delete && parm_delete_line && strcmp(parm_delete_line, "@"))
+      putCapability(expandParm(buffer, parm_delete_line, n));
+    else if (!delete && parm_insert_line && strcmp(parm_insert_line, "@"))
+      putCapability(expandParm(buffer, parm_insert_line, n));
+    else
+      while (n-- > 0)
+        putCapability(delete ? delete_line : insert_line);
+  }
+  normalAttributes           = oldNormalAttributes;
+  protected                  = oldProtected;
+  return(1);
+}
+
+
+static void optimizeOutput(void) {
+  /* If the application repainted (parts of) the screen, then it is often    */
+  /* cheaper to scroll the content that the terminal already shows, and to   */
+  /* only redraw the lines that actually changed. Generate this alternative  */
+  /* output on trial and keep whichever is shorter.                          */
+  static char   *directOutput;
+  static Cell   **image;
+  static int    imageSize;
+  int           width        = screenWidth;
+  int           height       = screenHeight;
+  int           directLength, directAttributes, directCursorHidden;
+  int           bestShift    = 0, bestMatches = 0;
+  int           top = 0, bottom = -1, shift, y, y1;
+  unsigned int  blankHash;
+  unsigned int  *hashes;
+  Cell          *blankRow;
+
+  if (checkpointLength < 0)
+    return;
+  flushCursor();
+  directLength               = outputBufferLength - checkpointLength;
+  if (checkpointLength < 0 || directLength < width ||
+      checkpointBuffer != currentBuffer || insertMode ||
+      checkpointWidth != width || checkpointHeight != height) {
+    checkpointLength         = -1;
+    return;
+  }
+
+  /* Find the scroll distance that lets most of the changed lines be reused  */
+  hashes                     = malloc(height * sizeof(unsigned int));
+  blankRow                   = malloc(width * sizeof(Cell));
+  fillCells(blankRow, BLANK_CELL, width);
+  blankHash                  = hashRow(blankRow, width);
+  for (y = 0; y < height; y++)
+    hashes[y]                = hashRow(currentBuffer->cells[y], width);
+  for (shift = 1 - height; shift < height; shift++) {
+    int matches              = 0;
+
+    if (!shift)
+      continue;
+    for (y = shift > 0 ? 0 : -shift; y < height && y + shift < height; y++)
+      if (hashes[y] != checkpointHashes[y] && hashes[y] != blankHash &&
+          hashes[y] == checkpointHashes[y + shift] &&
+          compareCells(currentBuffer->cells[y],
+                       checkpointCells + (y + shift)*width, width) == width)
+        matches++;
+    if (matches > bestMatches ||
+        (matches == bestMatches && matches &&
+         abs(shift) < abs(bestShift))) {
+      bestMatches            = matches;
+      bestShift              = shift;
+    }
+  }
+  if (bestShift) {
+    /* Determine the region that has to be scrolled                          */
+    for (y = 0; y < height; y++)
+      if (y + bestShift >= 0 && y + bestShift < height &&
+          hashes[y] != checkpointHashes[y] && hashes[y] != blankHash &&
+          hashes[y] == checkpointHashes[y + bestShift] &&
+          compareCells(currentBuffer->cells[y],
+                       checkpointCells + (y + bestShift)*width,
+                       width) == width) {
+        if (bottom < 0)
+          top                = y;
+        bottom               = y;
+      }
+    if (bestShift > 0)
+      bottom                += bestShift;
+    else
+      top                   += bestShift;
+  }
+
+  /* Save the direct output and rewind the terminal state to the checkpoint  */
+  directOutput               = realloc(directOutput, directLength);
+  memcpy(directOutput, outputBuffer + checkpointLength, directLength);
+  directAttributes           = currentAttributes;
+  directCursorHidden         = hostCursorIsHidden;
+  outputBufferLength         = checkpointLength;
+  checkpointTrial            = 1;
+  currentAttributes          = checkpointAttributes;
+  hostCursorIsHidden         = checkpointCursorHidden;
+  cursorPending              = 1;
+  cursorUnknown              = 0;
+  hostCursorX                = checkpointX;
+  hostCursorY                = checkpointY;
+  {
+    int x                    = currentBuffer->cursorX;
+    int cursorY              = currentBuffer->cursorY;
+
+    /* Work out what the terminal shows after scrolling                      */
+    if (imageSize < height)
+      image                  = realloc(image,
+                                       (imageSize = height)*sizeof(Cell *));
+    for (y = 0; y < height; y++)
+      image[y]               = checkpointCells + y*width;
+    if (bestShift && shiftHostLines(top, bottom, bestShift)) {
+      for (y = top; y <= bottom; y++)
+        image[y]             = y + bestShift >= top && y + bestShift <= bottom
+                               ? checkpointCells + (y + bestShift)*width
+                               : blankRow;
+    }
+
+    /* Redraw all lines that are still different                             */
+    for (y = 0; y < height; ) {
+      if (compareCells(currentBuffer->cells[y], image[y], width) == width) {
+        y++;
+        continue;
+      }
+      for (y1 = y++; y < height &&
+           compareCells(currentBuffer->cells[y], image[y], width) < width;
+           y++);
+      displayRows(y1, y - 1);
+    }
+    gotoXY(x, cursorY);
+    flushCursor();
+
+    /* The batch might also have shown or hidden the cursor                  */
+    setHostCursor(!directCursorHidden);
+  }
+  if (checkpointTrial < 0 ||
+      outputBufferLength - checkpointLength >= directLength) {
+    /* The direct output was shorter after all                               */
+    outputBufferLength       = checkpointLength;
+    memcpy(outputBuffer + outputBufferLength, directOutput, directLength);
+    outputBufferLength      += directLength;
+    currentAttributes        = directAttributes;
+    hostCursorIsHidden       = directCursorHidden;
+    cursorPending            = 0;
+  }
+  checkpointTrial            = 0;
+  checkpointLength           = -1;
+  free(hashes);
+  free(blankRow);
+  return;
+}
+
+
+static void fillUnprotected(int x1, int x2, int y, Cell cell) {
+  /* Fills the unprotected cells in columns x1..x2 of row "y". Only these    */
+  /* cells get sent to the terminal, protected fields are skipped over. The  */
+  /* attribute runs tell us where the fields start and end.                  */
+  int  oldX                      = currentBuffer->cursorX;
+  int  oldY                      = currentBuffer->cursorY;
+  int  oldNormalAttributes       = normalAttributes;
+  int  oldProtected              = protected;
+  int  redraw                    = 0;
+  Cell *cellPtr                  = currentBuffer->cells[y];
+  int  x;
+
+  for (x = x1; x <= x2; ) {
+    int run                      = attributeRun(currentBuffer, x, y,
+                                                x2 - x + 1);
+    if (CELL_ATTRIBUTES(cellPtr[x]) & T_PROTECTED) {
+      x                         += run;
+      continue;
+    }
+    gotoXY(x, y);
+    for (; run-- > 0; x++) {
+      if (x >= screenWidth || y >= screenHeight)
+        putCell(currentBuffer, x, y, cell);
+      else if (x == screenWidth-1 && y == screenHeight-1) {
+        putCell(currentBuffer, x, y, cell);
+        redraw                  |= !fillCorner();
+      } else {
+        if (cell == BLANK_CELL) {
+          normalAttributes       = T_NORMAL;
+          protected              = 0;
+          putBlank();
+          normalAttributes       = oldNormalAttributes;
+          protected              = oldProtected;
+          currentBuffer->cursorX++;
+        } else
+          drawCell(cell);
+        if (currentBuffer->cursorX >= screenWidth)
+          wrapCursor();
+      }
+    }
+  }
+  gotoXY(oldX, oldY);
+  if (redraw)
+    displayCurrentScreenBuffer();
+  return;
+}
+
+
 static void clearEol(void) {
   int  width                    = logicalWidth();
   int  height                   = logicalHeight();
@@ -2687,14 +4534,13 @@ static void clearEol(void) {
   if (writeProtection) {
     int x                        = currentBuffer->cursorX;
     int y                        = currentBuffer->cursorY;
-    unsigned short *attributePtr = currentBuffer->attributes[y];
-    char *charPtr                = currentBuffer->lineBuffer[y];
-    for (; x < width &&  (attributePtr[x] & T_PROTECTED); x++);
-    for (; x < width && !(attributePtr[x] & T_PROTECTED); x++) {
-      attributePtr[x]            = T_NORMAL;
-      charPtr[x]                 = ' ';
-    }
-    displayCurrentScreenBuffer();
+    Cell *cellPtr                = currentBuffer->cells[y];
+    int end;
+    for (; x < width &&  (CELL_ATTRIBUTES(cellPtr[x]) & T_PROTECTED); x++);
+    for (end = x;
+         end < width && !(CELL_ATTRIBUTES(cellPtr[end]) & T_PROTECTED);
+         end++);
+    fillUnprotected(x, end - 1, y, BLANK_CELL);
   } else {
     clearScreenBuffer(currentBuffer,
                       currentBuffer->cursorX, currentBuffer->cursorY,
@@ -2712,6 +4558,7 @@ static void clearEol(void) {
       if (insert_character && strcmp(insert_character, "@"))
         putCapability(insert_character);
       else {
+        commitOutput();
         if (!insertMode && enter_insert_mode && strcmp(enter_insert_mode, "@"))
           putCapability(enter_insert_mode);
         putConsole(' ');
@@ -2732,19 +4579,8 @@ static void clearEos(void) {
   if (writeProtection) {
     int x                          = currentBuffer->cursorX;
     int y                          = currentBuffer->cursorY;
-    for (; y < height; y++, x = 0) {
-      unsigned short *attributePtr = &currentBuffer->attributes[y][x];
-      char *charPtr                = &currentBuffer->lineBuffer[y][x];
-      for (; x < width; x++) {
-        if (!(*attributePtr & T_PROTECTED)) {
-          *attributePtr            = T_NORMAL;
-          *charPtr                 = ' ';
-        }
-        attributePtr++;
-        charPtr++;
-      }
-    }
-    displayCurrentScreenBuffer();
+    for (; y < height; y++, x = 0)
+      fillUnprotected(x, width - 1, y, BLANK_CELL);
   } else if (clr_eos && strcmp(clr_eos, "@")) {
     clearScreenBuffer(currentBuffer,
                       currentBuffer->cursorX, currentBuffer->cursorY,
@@ -2776,6 +4612,27 @@ static void clearEos(void) {
 }
 
 
+static void clearEndOfSegment(void) {
+  /* Erases from the cursor to the end of the active text segment.           */
+  int oldX                         = currentBuffer->cursorX;
+  int oldY                         = currentBuffer->cursorY;
+  int bottom                       = segmentBottom();
+  int i;
+
+  if (bottom == logicalHeight() - 1) {
+    clearEos();
+    return;
+  }
+  for (i = oldY; i <= bottom; i++) {
+    if (i > oldY)
+      gotoXYforce(0, i);
+    clearEol();
+  }
+  gotoXYforce(oldX, oldY);
+  return;
+}
+
+
 static void fillScreen(unsigned short attributes, const char fillChar) {
   int  width                       = logicalWidth();
   int  height                      = logicalHeight();
@@ -2785,22 +4642,14 @@ static void fillScreen(unsigned short attributes, const char fillChar) {
     int foundHome                  = 0;
 
     for (y = 0; y < height; y++) {
-      char *charPtr                = currentBuffer->lineBuffer[y];
-      unsigned short *attributePtr = currentBuffer->attributes[y];
-      for (x = 0; x < width; x++) {
-        if (*attributePtr++ & T_PROTECTED) {
-          charPtr++;
-        } else {
-          if (!foundHome) {
-            foundHome++;
-            currentBuffer->cursorX = x;
-            currentBuffer->cursorY = y;
-          }
-          *charPtr++               = fillChar;
-          attributePtr[-1]         = attributes;
+      Cell *cellPtr                = currentBuffer->cells[y];
+      for (x = 0; x < width && !foundHome; x++) {
+        if (!(CELL_ATTRIBUTES(cellPtr[x]) & T_PROTECTED)) {
+          foundHome++;
+          gotoXY(x, y);
         }
       }
-      displayCurrentScreenBuffer();
+      fillUnprotected(0, width - 1, y, CELL(attributes, fillChar));
     }
   } else if (attributes != T_NORMAL || fillChar != ' ') {
     clearScreenBuffer(currentBuffer, 0, 0, width-1, height-1,
@@ -2830,34 +4679,89 @@ static void clearScreen() {
 }
 
 
+static int hostScreen(int page) {
+  /* Page 0 is shown on the host's primary screen, all other pages use the   */
+  /* alternate screen (if the terminal has one).                             */
+  return(page && enter_ca_mode && strcmp(enter_ca_mode, "@") &&
+         exit_ca_mode && strcmp(exit_ca_mode, "@"));
+}
+
+
+static void invalidateHostScreens(void) {
+  /* Forget about the content of the host screen that is not currently       */
+  /* visible, e.g. after resizing or suspending the terminal.                */
+  hostScreenPage[!hostScreen(currentPage)]
+                             = -1;
+  hostScreenPage[hostScreen(currentPage)]
+                             = currentPage;
+  return;
+}
+
+
 static void setPage(int page) {
   if (page < 0)
     page                      = 0;
   else if (page > 2)
     page                      = 2;
   if (page != currentPage) {
+    int oldScreen            = hostScreen(currentPage);
+    int newScreen            = hostScreen(page);
+
     clearExcessBuffers();
-    if (page && !currentPage) {
-      if (enter_ca_mode && strcmp(enter_ca_mode, "@"))
-        putCapability(enter_ca_mode);
-    } else if (!page && currentPage) {
-      if (exit_ca_mode && strcmp(exit_ca_mode, "@"))
-        putCapability(exit_ca_mode);
-    }
+    commitOutput();
+    if (newScreen && !oldScreen) {
+      putCapability(enter_ca_mode);
+
+      /* Entering the alternate screen usually clears it                     */
+      hostScreenPage[1]      = -1;
+    } else if (!newScreen && oldScreen)
+      putCapability(exit_ca_mode);
+    hostScreenViewport[oldScreen]
+                             = currentBuffer->viewportY;
     currentPage              = page;
+    if (screenBuffer[page] == NULL)
+      screenBuffer[page]     = adjustScreenBuffer(NULL, screenWidth,
+                                                  pageFactor[page] *
+                                                  screenHeight);
     currentBuffer            = screenBuffer[page];
-    displayCurrentScreenBuffer();
+    if (newScreen != oldScreen && hostScreenPage[newScreen] == page &&
+        hostScreenViewport[newScreen] == currentBuffer->viewportY) {
+      /* The host restored a screen that still shows this page. Only the     */
+      /* cursor position and the attributes need to be brought up to date.   */
+      currentAttributes      = -1;
+      gotoXYforce(currentBuffer->cursorX, currentBuffer->cursorY);
+    } else
+      displayCurrentScreenBuffer();
+    hostScreenPage[newScreen]= page;
   }
   return;
 }
 
 
+static void setPageLayout(int factor0, int factor1, int factor2) {
+  /* Divides the terminal memory into pages. Each page holds a multiple of   */
+  /* the number of data lines; pages that are taller than the display can    */
+  /* be scrolled through.                                                    */
+  int oldViewport              = currentBuffer->viewportY;
+
+  pageFactor[0]                = factor0;
+  pageFactor[1]                = factor1;
+  pageFactor[2]                = factor2;
+  adjustScreenBuffers(screenWidth, screenHeight);
+  if (currentBuffer->viewportY != oldViewport)
+    displayCurrentScreenBuffer();
+  return;
+}
+
+
 static void putGraphics(char ch) {
   if (ch == '\x02')
     graphicsMode                  = 1;
   else if (ch == '\x03')
     graphicsMode                  = 0;
   else if ((ch &= 0x3F) >= '0' && ch <= '?') {
+    flushCursor();
+    updateAttributes();
     if (acs_chars &&
         enter_alt_charset_mode && strcmp(enter_alt_charset_mode, "@")) {
       static const char map[]     = "wmlktjx0nuqaqvxa";
@@ -2870,10 +4774,9 @@ static void putGraphics(char ch) {
         unsigned short attributes = (unsigned short)currentAttributes |
                                     T_GRAPHICS;
     
-        currentBuffer->lineBuffer[cursorY][cursorX] = ch;
         if (protected)
           attributes             |= T_PROTECTED;
-        currentBuffer->attributes[cursorY][cursorX] = attributes;
+        putCell(currentBuffer, cursorX, cursorY, CELL(attributes, ch));
       }
       ch                      = map[ch - '0'];
       for (ptr = acs_chars; ptr[0] && ptr[1] && *ptr != ch; ptr += 2);
@@ -2916,18 +4819,56 @@ static void putGraphics(char ch) {
 }
 
 
-static void showCursor(int flag) {
-  if (!cursorIsHidden != flag) {
+static void setHostCursor(int flag) {
+  if (!hostCursorIsHidden != flag) {
     if (flag) {
       if (cursor_visible && strcmp(cursor_visible, "@"))
-        putCapability(cursor_visible);
+        _putCapability(cursor_visible);
       if (cursor_normal && strcmp(cursor_normal, "@"))
-        putCapability(cursor_normal);
+        _putCapability(cursor_normal);
     } else {
       if (cursor_invisible && strcmp(cursor_invisible, "@"))
-        putCapability(cursor_invisible);
+        _putCapability(cursor_invisible);
     }
-    cursorIsHidden = !flag;
+    hostCursorIsHidden = !flag;
+  }
+  return;
+}
+
+
+static void showCursor(int flag) {
+  /* Remembers the cursor visibility that the application asked for. While   */
+  /* a large burst of output is being processed, the cursor stays hidden     */
+  /* and is only restored once the burst has been written to the terminal.   */
+  cursorIsHidden       = !flag;
+  if (!cursorBurst)
+    setHostCursor(flag);
+  return;
+}
+
+
+static void startCursorBurst(int count) {
+  if (cursorBurstSize > 0 && count >= cursorBurstSize) {
+    cursorBurst        = 1;
+    setHostCursor(0);
+  }
+  return;
+}
+
+
+static void endCursorBurst(int pty) {
+  if (cursorBurst) {
+    struct pollfd descriptor;
+
+    /* Keep the cursor hidden, as long as the application has more output    */
+    descriptor.fd      = pty;
+    descriptor.events  = POLLIN;
+    if (historyViewOffset < 0 && !outputStopped &&
+        poll(&descriptor, 1, 0) > 0 &&
+        (descriptor.revents & POLLIN))
+      return;
+    cursorBurst        = 0;
+    setHostCursor(!cursorIsHidden);
   }
   return;
 }
@@ -3148,12 +5089,16 @@ static void sendResetStrings(void) {
 
 
 static void _resetTerminal(int resetSize) {
+  /* The reset sequences must reach the terminal, even if we exit while      */
+  /* output is being skipped.                                                */
+  skippingOutput = 0;
   flushConsole();
 
   if (needsReset) {
     needsReset = 0;
 
-    showCursor(1);
+    cursorBurst = 0;
+    setHostCursor(1);
     sendResetStrings();
     reset_shell_mode();
 
@@ -3222,6 +5167,7 @@ static char *readResponse(int timeout, const char *query, char *buffer,
     }
   } while (i);
 
+  flushCursor();
   writeConsole(query, strlen(query));
   flushConsole();
 
@@ -3304,39 +5250,371 @@ static int queryCursorPosition(int *x, int *y) {
 }
 
 
-static void addKeyboardTranslation(const char *name,
-                                   const char *nativeKeys,
-                                   const char *wy60Keys) {
-  KeyDefs **definitionPtr            = &keyDefinitions;
-  const char *keys                   = "";
+static void addKeyboardTranslation(const char *name,
+                                   const char *nativeKeys,
+                                   const char *wy60Keys) {
+  KeyDefs **definitionPtr            = &keyDefinitions;
+  const char *keys                   = "";
+
+  if (nativeKeys && wy60Keys) {
+    while (*nativeKeys) {
+      while (*definitionPtr != NULL) {
+        if ((*definitionPtr)->ch == *nativeKeys) {
+          break;
+        } else if ((*definitionPtr)->ch > *nativeKeys)
+          definitionPtr              = &(*definitionPtr)->left;
+        else
+          definitionPtr              = &(*definitionPtr)->right;
+      }
+      if (*definitionPtr == NULL) {
+        *definitionPtr               = calloc(sizeof(KeyDefs), 1);
+        (*definitionPtr)->ch         = *nativeKeys;
+        keys                         = strcpy(calloc(strlen(keys) + 2,1),keys);
+        *strrchr(keys, '\000')       = *nativeKeys;
+        (*definitionPtr)->nativeKeys = keys;
+      } else
+        keys                         = (*definitionPtr)->nativeKeys;
+      if (*++nativeKeys) {
+        definitionPtr                = &(*definitionPtr)->down;
+      }
+    }
+    if (*definitionPtr != NULL && (*definitionPtr)->name == NULL) {
+      (*definitionPtr)->name         = name;
+      (*definitionPtr)->wy60Keys     = wy60Keys;
+    }
+  }
+  return;
+}
+
+
+static void showHistory(void) {
+  /* Renders the history viewer. The history is followed by the memory of    */
+  /* page 0, and "historyViewOffset" counts how many lines the view has      */
+  /* been scrolled back from the viewport of page 0.                         */
+  ScreenBuffer *oldBuffer           = currentBuffer;
+  ScreenBuffer *page                = screenBuffer[0];
+  int          top                  = historyCount + page->viewportY -
+                                      historyViewOffset;
+  int          y;
+
+  if (historyView == NULL ||
+      historyView->maximumWidth  < screenWidth ||
+      historyView->maximumHeight < screenHeight) {
+    if (historyView)
+      freeScreenBuffer(historyView);
+    historyView                     = allocateScreenBuffer(screenWidth,
+                                                           screenHeight);
+  }
+  for (y = 0; y < screenHeight; y++) {
+    if (top + y < historyCount) {
+      HistoryLine *line             = historyLines[(historyStart + top + y) %
+                                                   historySize];
+      decodeHistoryLine(historyLineData(line), line->length,
+                        historyView->cells[y], screenWidth);
+    } else
+      memcpy(historyView->cells[y],
+             page->memory[top + y - historyCount],
+             screenWidth * sizeof(Cell));
+    refreshAttributeSpans(historyView, y, y);
+  }
+  historyView->cursorX              = 0;
+  historyView->cursorY              = screenHeight - 1;
+  currentBuffer                     = historyView;
+  displayCurrentScreenBuffer();
+  currentBuffer                     = oldBuffer;
+  return;
+}
+
+
+static void scrollHistory(int rows) {
+  if (historyViewOffset < 0)
+    historyViewOffset               = 0;
+  historyViewOffset                += rows;
+  if (historyViewOffset > historyCount + screenBuffer[0]->viewportY)
+    historyViewOffset               = historyCount +
+                                      screenBuffer[0]->viewportY;
+  if (historyViewOffset <= 0) {
+    historyViewOffset               = -1;
+    displayCurrentScreenBuffer();
+  } else
+    showHistory();
+  return;
+}
+
+
+static int historyKeyReceived(const char *buffer, int count) {
+  /* Interprets keyboard input while the history viewer is active. Returns   */
+  /* the number of bytes that were consumed. Any key that the viewer does    */
+  /* not know about closes the viewer and is then processed normally.        */
+  const struct {
+    const char *keys;
+    int        rows;
+  } commands[]                      = {
+    { cfgScrollbackKey, -2 },
+    { key_sprevious, -2 }, { key_snext, 2 }, { key_ppage, -2 },
+    { key_npage,   2 },    { key_up,   -1 }, { key_down,  1 },
+    { "b",        -2 },    { " ",       2 } };
+  int page                          = screenHeight > 1 ? screenHeight-1 : 1;
+  int i;
+
+  for (i = 0; i < sizeof(commands)/sizeof(*commands); i++) {
+    const char *keys                = commands[i].keys;
+    int        length;
+
+    if (keys && *keys && strcmp(keys, "@") &&
+        (length = strlen(keys)) <= count && !memcmp(buffer, keys, length)) {
+      int rows                     = commands[i].rows;
+      if (rows == -2 || rows == 2)
+        rows                       = rows/2 * page;
+      scrollHistory(-rows);
+      return(length);
+    }
+  }
+  if (*buffer == 'q' || *buffer == 'Q' || *buffer == '\x1B' ||
+      *buffer == '\r') {
+    scrollHistory(-historyViewOffset);
+    return(1);
+  }
+  scrollHistory(-historyViewOffset);
+  return(0);
+}
+
+
+static void drawPrediction(Prediction *prediction) {
+  /* Shows a predicted echo on the terminal without entering it into the     */
+  /* screen buffer. It is underlined until the application confirms it.      */
+  int oldX                   = currentBuffer->cursorX;
+  int oldY                   = currentBuffer->cursorY;
+  int oldNormalAttributes    = normalAttributes;
+  int oldProtectedAttributes = protectedAttributes;
+  int oldProtected           = protected;
+
+  gotoXY(prediction->x, prediction->y);
+  flushCursor();
+  protected                  = 0;
+  normalAttributes           =
+  protectedAttributes        = (CELL_ATTRIBUTES(prediction->original) &
+                                T_ALL) | T_UNDERSCORE;
+  updateAttributes();
+  _putConsole(prediction->ch);
+  logHostCharacter(0, prediction->ch);
+  currentBuffer->cursorX++;
+  normalAttributes           = oldNormalAttributes;
+  protectedAttributes        = oldProtectedAttributes;
+  protected                  = oldProtected;
+  gotoXY(oldX, oldY);
+  prediction->shown          = 1;
+  return;
+}
+
+
+static void hidePredictions(void) {
+  /* Restores the cells underneath all predicted echos from the screen       */
+  /* buffer, so that the terminal matches the screen buffer again.           */
+  int oldX                   = currentBuffer->cursorX;
+  int oldY                   = currentBuffer->cursorY;
+  int hidden                 = 0;
+  int i;
+
+  for (i = 0; i < predictionCount; i++) {
+    Prediction *prediction   = predictions + i;
+
+    if (prediction->shown) {
+      prediction->shown      = 0;
+      if (prediction->x < screenWidth && prediction->y < screenHeight) {
+        gotoXY(prediction->x, prediction->y);
+        drawCell(currentBuffer->cells[prediction->y][prediction->x]);
+        hidden               = 1;
+      }
+    }
+  }
+  if (hidden)
+    gotoXY(oldX, oldY);
+  return;
+}
+
+
+static void showPredictions(void) {
+  /* Predictions only become visible, once the application has confirmed     */
+  /* that it echoes what the user types.                                     */
+  int i;
+
+  if (predictionConfirmed && historyViewOffset < 0)
+    for (i = 0; i < predictionCount; i++)
+      if (!predictions[i].shown)
+        drawPrediction(predictions + i);
+  return;
+}
+
+
+static int showPredictedCursor(void) {
+  /* While predictions are visible, the cursor is left after the last one,   */
+  /* as that is where the application is going to put it. Returns zero, if   */
+  /* the cursor should go to its actual position instead.                    */
+  Prediction *last;
+
+  if (!predictionCount || historyViewOffset >= 0)
+    return(0);
+  last                       = predictions + predictionCount - 1;
+  if (!last->shown)
+    return(0);
+  if (!cursorPending || cursorUnknown || blankCount || scrollPending ||
+      hostCursorX != last->x + 1 || hostCursorY != last->y) {
+    flushCursor();
+    moveCursor(currentBuffer->cursorX, currentBuffer->cursorY,
+               last->x + 1, last->y);
+    cursorPending            = 1;
+    cursorUnknown            = 0;
+    hostCursorX              = last->x + 1;
+    hostCursorY              = last->y;
+  }
+  return(1);
+}
+
+
+static void checkPredictions(void) {
+  /* Compares the predictions with what the application actually did. Echos  */
+  /* that arrived are confirmed, while a mismatch throws away all of the     */
+  /* predictions and turns them off until the user presses a key that is     */
+  /* not a plain printable character. Predictions that the application does  */
+  /* not confirm within a couple of seconds are given up on, too.            */
+  int i, count;
+
+  for (i = count = 0; i < predictionCount; i++) {
+    Prediction *prediction   = predictions + i;
+    Cell       cell;
+
+    if (prediction->x >= screenWidth || prediction->y >= screenHeight) {
+      predictionCount        = 0;
+      return;
+    }
+    cell                     = currentBuffer->cells[prediction->y]
+                                                   [prediction->x];
+    if (cell != prediction->original) {
+      if (CELL_CHARACTER(cell) != prediction->ch) {
+        hidePredictions();
+        predictionCount      =
+        predictionConfirmed  = 0;
+        predictionFailed     = 1;
+        return;
+      }
+      predictionConfirmed    = 1;
+    } else
+      predictions[count++]   = *prediction;
+  }
+  predictionCount            = count;
+  if (count && currentTime() - predictions[0].time >= 2000) {
+    hidePredictions();
+    predictionCount          =
+    predictionConfirmed      = 0;
+  }
+  return;
+}
+
+
+static void predictEcho(char ch) {
+  /* Guesses how the application is going to echo a keystroke. Only plain    */
+  /* printable characters that go into an unprotected field are predicted;   */
+  /* fields that do not display their content (e.g. passwords) are skipped.  */
+  Prediction *prediction;
+  Cell       cell;
+  int        x, y;
+
+  if (!predictiveEcho)
+    return;
+  if ((unsigned char)ch < ' ' || (unsigned char)ch >= '\x7F') {
+    /* The application could go just about anywhere after any other key.     */
+    /* Wait for it to confirm its echo again, before showing predictions.    */
+    predictionConfirmed      =
+    predictionFailed         = 0;
+    return;
+  }
+  if (predictionFailed || historyViewOffset >= 0 || insertMode || blockMode ||
+      predictionCount == sizeof(predictions)/sizeof(*predictions))
+    return;
+  if (predictionCount) {
+    x                        = predictions[predictionCount - 1].x + 1;
+    y                        = predictions[predictionCount - 1].y;
+  } else {
+    x                        = currentBuffer->cursorX;
+    y                        = currentBuffer->cursorY;
+  }
+  if (x >= logicalWidth() - 1 || x >= screenWidth - 1 ||
+      y >= logicalHeight() || y >= screenHeight)
+    return;
+  cell                       = currentBuffer->cells[y][x];
+  if ((writeProtection && (CELL_ATTRIBUTES(cell) & T_PROTECTED)) ||
+      ((CELL_ATTRIBUTES(cell) | desiredAttributes()) & T_BLANK)) {
+    predictionFailed         = 1;
+    return;
+  }
+  prediction                 = predictions + predictionCount++;
+  prediction->x              = x;
+  prediction->y              = y;
+  prediction->ch             = ch;
+  prediction->original       = cell;
+  prediction->shown          = 0;
+  prediction->time           = currentTime();
+  showPredictions();
+  return;
+}
+
+
+static int isLocalEditKey(const char *keys, int length) {
+  /* Checks whether a key sequence is one of the editing functions that the  */
+  /* terminal executes by itself, while in local edit mode.                  */
+  static const char *editKeys[] = { "\b", "\t", "\n", "\v", "\f", "\x1E",
+                                    "\x1B" "E", "\x1B" "I", "\x1B" "Q",
+                                    "\x1B" "R", "\x1B" "T", "\x1B" "W",
+                                    "\x1B" "Y", "\x1B" "q", "\x1B" "r" };
+  int i;
+
+  for (i = 0; i < sizeof(editKeys)/sizeof(*editKeys); i++)
+    if (strlen(editKeys[i]) == length && !memcmp(editKeys[i], keys, length))
+      return(1);
+  return(0);
+}
+
+
+static void executeKeys(int pty, const char *keys, int length) {
+  /* Interprets keystrokes right here, as if the application had echoed      */
+  /* them.                                                                   */
+  int oldMode                = mode;
+  int i;
+
+  hidePredictions();
+  mode                       = E_NORMAL;
+  for (i = 0; i < length; i++)
+    outputCharacter(pty, keys[i]);
+  flushEdits();
+  mode                       = oldMode;
+  showPredictions();
+  return;
+}
+
 
-  if (nativeKeys && wy60Keys) {
-    while (*nativeKeys) {
-      while (*definitionPtr != NULL) {
-        if ((*definitionPtr)->ch == *nativeKeys) {
-          break;
-        } else if ((*definitionPtr)->ch > *nativeKeys)
-          definitionPtr              = &(*definitionPtr)->left;
-        else
-          definitionPtr              = &(*definitionPtr)->right;
-      }
-      if (*definitionPtr == NULL) {
-        *definitionPtr               = calloc(sizeof(KeyDefs), 1);
-        (*definitionPtr)->ch         = *nativeKeys;
-        keys                         = strcpy(calloc(strlen(keys) + 2,1),keys);
-        *strrchr(keys, '\000')       = *nativeKeys;
-        (*definitionPtr)->nativeKeys = keys;
-      } else
-        keys                         = (*definitionPtr)->nativeKeys;
-      if (*++nativeKeys) {
-        definitionPtr                = &(*definitionPtr)->down;
-      }
-    }
-    if (*definitionPtr != NULL && (*definitionPtr)->name == NULL) {
-      (*definitionPtr)->name         = name;
-      (*definitionPtr)->wy60Keys     = wy60Keys;
+static void transmitKeys(int pty, const char *keys, int length) {
+  /* Sends keystrokes to the application. In local edit mode, the editing    */
+  /* keys are executed locally instead, saving a round trip to the host for  */
+  /* each of them. In block mode, all data and editing keys stay local, and  */
+  /* the screen is only transmitted when the user presses the SEND key.      */
+  if (historyViewOffset < 0 && isPrinting == P_OFF) {
+    if (blockMode && length == 2 && !memcmp(keys, "\x1B" "7", 2)) {
+      sendScreen(pty, 0, writeProtection, 1);
+      return;
+    } else if (blockMode && length == 1 && *keys == '\r') {
+      executeKeys(pty, "\r\n", 2);
+      return;
+    } else if (((localEditMode || blockMode) &&
+                isLocalEditKey(keys, length)) ||
+               (blockMode && length == 1 &&
+                (unsigned char)*keys >= ' ' && *keys != '\x7F')) {
+      executeKeys(pty, keys, length);
+      return;
     }
   }
+  logCharacters(0, keys, length);
+  write(pty, keys, length);
   return;
 }
 
@@ -3347,6 +5625,10 @@ static void userInputReceived(int pty, const char *buffer, int count) {
   for (i = 0; i < count; i++) {
     char ch                  = buffer[i];
 
+    if (historyViewOffset >= 0) {
+      i                     += historyKeyReceived(buffer + i, count - i) - 1;
+      continue;
+    }
     logHostKey(ch);
     KeyDefs *nextKeySequence = currentKeySequence
                                ? currentKeySequence->down : keyDefinitions;
@@ -3354,12 +5636,17 @@ static void userInputReceived(int pty, const char *buffer, int count) {
 
     for (;;) {
       if (nextKeySequence->ch == ch) {
-        if (nextKeySequence->down == NULL) {
+        if (nextKeySequence->down == NULL &&
+            nextKeySequence->wy60Keys == historyKey) {
+          /* Open the history viewer                                         */
+          currentKeySequence = NULL;
+          scrollHistory(screenHeight > 1 ? screenHeight - 1 : 1);
+          break;
+        } else if (nextKeySequence->down == NULL) {
           /* Found a match. Translate key sequence now.                      */
-          logCharacters(0, nextKeySequence->wy60Keys,
-                        strlen(nextKeySequence->wy60Keys));
-          write(pty, nextKeySequence->wy60Keys,
-                strlen(nextKeySequence->wy60Keys));
+          predictEcho(0);
+          transmitKeys(pty, nextKeySequence->wy60Keys,
+                       strlen(nextKeySequence->wy60Keys));
           currentKeySequence = NULL;
           break;
         } else {
@@ -3372,12 +5659,20 @@ static void userInputReceived(int pty, const char *buffer, int count) {
           int length;
         noTranslation:
           length             = strlen(nextKeySequence->nativeKeys);
-          if (length > 1) {
-            logCharacters(0, nextKeySequence->nativeKeys, length-1);
-            write(pty, nextKeySequence->nativeKeys, length-1);
+          predictEcho(length > 1 ? 0 : ch);
+          if (length == 2) {
+            char keys[2];
+
+            keys[0]          = nextKeySequence->nativeKeys[0];
+            keys[1]          = ch;
+            transmitKeys(pty, keys, 2);
+          } else {
+            if (length > 1) {
+              logCharacters(0, nextKeySequence->nativeKeys, length-1);
+              write(pty, nextKeySequence->nativeKeys, length-1);
+            }
+            transmitKeys(pty, &ch, 1);
           }
-          logCharacters(0, &ch, 1);
-          write(pty, &ch, 1);
           currentKeySequence = NULL;
           break;
         } else {
@@ -3493,13 +5788,18 @@ static void flushPrinter(void) {
 }
 
 
-static void updateAttributes(void) {
-  int attributes;
+static int desiredAttributes(void) {
+  /* Returns the attributes that the application asked for. The terminal     */
+  /* only gets updated by updateAttributes(), when output is generated.      */
+  if (protected)
+    return(normalAttributes | protectedAttributes);
+  else
+    return(normalAttributes);
+}
 
-  if (protected) {
-    attributes            = normalAttributes | protectedAttributes;
-  } else
-    attributes            = normalAttributes;
+
+static void updateAttributes(void) {
+  int attributes          = desiredAttributes();
 
   if (attributes != currentAttributes) {
     char buffer[1024];
@@ -3513,18 +5813,18 @@ static void updateAttributes(void) {
 
       if (currentAttributes & T_REVERSE)
         if (exit_standout_mode && strcmp(exit_standout_mode, "@"))
-          putCapability(exit_standout_mode);
+          _putCapability(exit_standout_mode);
       if (!(orig_pair && strcmp(orig_pair, "@")) || color) {
         if (!color)
           color           = 9; /* reset color to default value */
         else if (color == 7)
           color           = 6; /* white does not display on white background */
-        putCapability(expandParm(buffer, set_a_foreground, color));
+        _putCapability(expandParm(buffer, set_a_foreground, color));
       } else
-        putCapability(orig_pair);
+        _putCapability(orig_pair);
       if (attributes & T_REVERSE)
         if (enter_standout_mode && strcmp(enter_standout_mode, "@"))
-          putCapability(enter_standout_mode);
+          _putCapability(enter_standout_mode);
 
       /* Terminal supports non-ANSI colors (probably in the range 0..7)      */
     } else if (set_foreground && strcmp(set_foreground, "@") &&
@@ -3535,16 +5835,16 @@ static void updateAttributes(void) {
 
       if (currentAttributes & T_REVERSE)
         if (exit_standout_mode && strcmp(exit_standout_mode, "@"))
-          putCapability(exit_standout_mode);
+          _putCapability(exit_standout_mode);
       if (color) {
         if (color == 7)
           color           = 6; /* white does not display on white background */
-        putCapability(expandParm(buffer, set_foreground, color));
+        _putCapability(expandParm(buffer, set_foreground, color));
       } else
-        putCapability(orig_pair);
+        _putCapability(orig_pair);
       if (attributes & T_REVERSE)
         if (enter_standout_mode && strcmp(enter_standout_mode, "@"))
-          putCapability(enter_standout_mode);
+          _putCapability(enter_standout_mode);
 
       /* Terminal doesn't support colors, but can set multiple attributes at */
       /* once                                                                */
@@ -3558,7 +5858,13 @@ static void updateAttributes(void) {
                    (!(attributes & T_REVERSE) || !protected),
                    (attributes & T_BOTH) == T_BOTH && protected,
                    0, 0, 0)) {
-      putCapability(buffer);
+      /* Turning all attributes off can be faster with a separate capability */
+      if (!(attributes & (T_UNDERSCORE | T_REVERSE | T_BLINK | T_DIM)) &&
+          exit_attribute_mode && strcmp(exit_attribute_mode, "@") &&
+          capabilityCost(exit_attribute_mode) < capabilityCost(buffer))
+        _putCapability(exit_attribute_mode);
+      else
+        _putCapability(buffer);
 
       /* Terminal can only set some attributes. It might or might not        */
       /* support combinations of attributes.                                 */
@@ -3566,39 +5872,39 @@ static void updateAttributes(void) {
       int isBoth           = 0;
 
       if (exit_attribute_mode && strcmp(exit_attribute_mode, "@"))
-        putCapability(exit_attribute_mode);
+        _putCapability(exit_attribute_mode);
       else {
         if (currentAttributes & (T_DIM | T_UNDERSCORE))
           if (exit_underline_mode && strcmp(exit_underline_mode, "@"))
-            putCapability(exit_underline_mode);
+            _putCapability(exit_underline_mode);
         if (currentAttributes & T_REVERSE)
           if (exit_standout_mode && strcmp(exit_standout_mode, "@"))
-            putCapability(exit_standout_mode);
+            _putCapability(exit_standout_mode);
       }
       if ((attributes & T_BOTH) == T_BOTH &&
           exit_attribute_mode && strcmp(exit_attribute_mode, "@") &&
           enter_bold_mode     && strcmp(enter_bold_mode,     "@")) {
-        putCapability(enter_bold_mode);
+        _putCapability(enter_bold_mode);
         isBoth            = 1;
       }
       if (attributes & T_BLINK &&
           exit_attribute_mode && strcmp(exit_attribute_mode, "@") &&
           enter_blink_mode    && strcmp(enter_blink_mode,    "@"))
-        putCapability(enter_blink_mode);
+        _putCapability(enter_blink_mode);
       if (attributes & T_UNDERSCORE &&
           enter_underline_mode && strcmp(enter_underline_mode, "@"))
-        putCapability(enter_underline_mode);
+        _putCapability(enter_underline_mode);
       if ((attributes & T_DIM) && !isBoth) {
         if (exit_attribute_mode && strcmp(exit_attribute_mode, "@") &&
             enter_dim_mode      && strcmp(enter_dim_mode,      "@"))
-          putCapability(enter_dim_mode);
+          _putCapability(enter_dim_mode);
         else if (enter_underline_mode && strcmp(enter_underline_mode, "@") &&
                  !(attributes & T_UNDERSCORE))
-          putCapability(enter_underline_mode);
+          _putCapability(enter_underline_mode);
       }
       if ((attributes & T_REVERSE) && !isBoth)
         if (enter_standout_mode && strcmp(enter_standout_mode, "@"))
-          putCapability(enter_standout_mode);
+          _putCapability(enter_standout_mode);
     }
 
     currentAttributes     = attributes;
@@ -3610,7 +5916,6 @@ static void updateAttributes(void) {
 static void setFeatures(int attributes) {
   attributes           &= T_ALL;
   protectedPersonality  = attributes;
-  updateAttributes();
   return;
 }
 
@@ -3621,14 +5926,12 @@ static void setAttributes(int attributes) {
     protectedAttributes = attributes | protectedPersonality;
   else
     normalAttributes    = attributes;
-  updateAttributes();
   return;
 }
 
 
 static void setProtected(int flag) {
   protected = flag;
-  updateAttributes();
   return;
 }
 
@@ -3639,6 +5942,199 @@ static void setWriteProtection(int flag) {
 }
 
 
+static int rowEnd(void) {
+  return(logicalWidth() < screenWidth ? logicalWidth() : screenWidth);
+}
+
+
+static void flushCharacterShift(void) {
+  /* Consecutive requests for inserting or deleting characters at the same   */
+  /* position are combined into a single operation.                          */
+  int  x                     = shiftX;
+  int  y                     = shiftY;
+  int  count                 = shiftCount > 0 ? shiftCount : -shiftCount;
+  int  i;
+  char buffer[1024];
+
+  if (!shiftCount)
+    return;
+  if (count > rowEnd() - x)
+    count                    = rowEnd() - x;
+  if (shiftCount > 0) {
+    shiftCount               = 0;
+    _moveScreenBuffer(currentBuffer, x, y, logicalWidth() - 1, y, count, 0);
+    if (expandParm(buffer, parm_ich, count) &&
+        !(insert_character && strcmp(insert_character, "@") &&
+          count*capabilityCost(insert_character) <= capabilityCost(buffer)))
+      putCapability(buffer);
+    else if (insert_character && strcmp(insert_character, "@")) {
+      for (i = count; i--; )
+        putCapability(insert_character);
+    } else {
+      commitOutput();
+      putCapability(enter_insert_mode);
+      for (i = count; i--; )
+        putConsole(' ');
+      if (!insertMode && exit_insert_mode && strcmp(exit_insert_mode, "@"))
+        putCapability(exit_insert_mode);
+      gotoXYforce(x, y);
+    }
+  } else {
+    shiftCount               = 0;
+    _moveScreenBuffer(currentBuffer, x + count, y, logicalWidth() - 1, y,
+                      -count, 0);
+    if (expandParm(buffer, parm_dch, count) &&
+        !(delete_character && strcmp(delete_character, "@") &&
+          count*capabilityCost(delete_character) <= capabilityCost(buffer)))
+      putCapability(buffer);
+    else
+      for (i = count; i--; )
+        putCapability(delete_character);
+  }
+  return;
+}
+
+
+static void shiftCharacters(int count) {
+  int x                      = currentBuffer->cursorX;
+  int y                      = currentBuffer->cursorY;
+
+  if (shiftCount && (x != shiftX || y != shiftY ||
+                     (shiftCount > 0) != (count > 0)))
+    flushCharacterShift();
+  shiftX                     = x;
+  shiftY                     = y;
+  shiftCount                += count;
+  return;
+}
+
+
+static void flushInsertRun(void) {
+  /* Moves the remainder of the line to the right of the characters that     */
+  /* were typed in insert mode.                                              */
+  int count                  = rowEnd() - insertRunX - insertRunCount;
+
+  if (insertRunCount) {
+    if (count > 0) {
+      memcpy(currentBuffer->cells[insertRunY] + insertRunX + insertRunCount,
+             insertRunTail, count * sizeof(Cell));
+      refreshAttributeSpans(currentBuffer, insertRunY, insertRunY);
+    }
+    insertRunCount           = 0;
+  }
+  return;
+}
+
+
+static void insertCharacter(void) {
+  /* In insert mode, the rest of the line has to make room for each new      */
+  /* character. Rather than shifting the line every single time, the old     */
+  /* content gets saved once and is put back after the last character.       */
+  int x                      = currentBuffer->cursorX;
+  int y                      = currentBuffer->cursorY;
+
+  /* A character in the last column does not extend the run; put the saved  */
+  /* tail back first, or it would later overwrite that character.            */
+  if (insertRunCount &&
+      (x != insertRunX + insertRunCount || y != insertRunY ||
+       x >= rowEnd() - 1))
+    flushInsertRun();
+  if (x >= rowEnd() - 1) {
+    _moveScreenBuffer(currentBuffer, x, y, logicalWidth() - 1, y, 1, 0);
+    return;
+  }
+  if (!insertRunCount) {
+    insertRunTail            = realloc(insertRunTail,
+                                       screenWidth * sizeof(Cell));
+    memcpy(insertRunTail, currentBuffer->cells[y] + x,
+           (rowEnd() - x) * sizeof(Cell));
+    insertRunX               = x;
+    insertRunY               = y;
+  }
+  insertRunCount++;
+  return;
+}
+
+
+static void flushEdits(void) {
+  flushCharacterShift();
+  flushInsertRun();
+  return;
+}
+
+
+static void sendScreen(int pty, int fromStartOfRow, int unprotectedOnly,
+                       int toEndOfPage) {
+  /* Transmits the contents of the screen to the host. The data starts at    */
+  /* either the beginning of the page or of the cursor row, and it extends   */
+  /* to either the cursor or the end of the page. Rows are separated by US,  */
+  /* protected fields (if skipped) collapse into a single field separator,   */
+  /* and the block is terminated by CR. Everything goes out in one write.    */
+  static const char rowSeparator   = '\x1F';
+  static const char fieldSeparator = '\t';
+  int               width          = logicalWidth();
+  int               height         = logicalHeight();
+  int               lastX          = width - 1;
+  int               lastY          = height - 1;
+  int               x, y, length, mark, inField;
+  char              *buffer;
+
+  if (!toEndOfPage) {
+    lastX                          = currentBuffer->cursorX;
+    lastY                          = currentBuffer->cursorY;
+    if (lastX >= width)
+      lastX                        = width - 1;
+    if (lastY >= height)
+      lastY                        = height - 1;
+  }
+  y                                = fromStartOfRow
+                                     ? currentBuffer->cursorY : 0;
+  if ((buffer                      = malloc(2*(width + 1)*(lastY - y + 1) +
+                                            1)) == NULL)
+    return;
+  for (length = mark = 0; y <= lastY; y++) {
+    inField                        = 0;
+    for (x = 0; x <= (y == lastY ? lastX : width - 1); x++) {
+      Cell cell                    = currentBuffer->cells[y][x];
+
+      if (unprotectedOnly && (CELL_ATTRIBUTES(cell) & T_PROTECTED)) {
+        if (inField) {
+          buffer[length++]         = fieldSeparator;
+          mark                     = length;
+          inField                  = 0;
+        }
+        continue;
+      }
+      buffer[length++]             = CELL_CHARACTER(cell)
+                                     ? CELL_CHARACTER(cell) : ' ';
+      inField                      = 1;
+    }
+
+    /* Trailing blanks carry no information.                                 */
+    while (length > mark && buffer[length - 1] == ' ')
+      length--;
+    if (y < lastY)
+      buffer[length++]             = rowSeparator;
+    mark                           = length;
+  }
+  buffer[length++]                 = '\r';
+
+  flushUserInput(pty);
+  logCharacters(0, buffer, length);
+  for (x = 0; x < length; ) {
+    int count                      = write(pty, buffer + x, length - x);
+    if (count <= 0) {
+      if (count < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    x                             += count;
+  }
+  free(buffer);
+  return;
+}
+
+
 static void escape(int pty,char ch) {
   mode           = E_NORMAL;
   switch (ch) {
@@ -3698,19 +6194,16 @@ static void escape(int pty,char ch) {
     fillScreen(T_PROTECTED | protectedPersonality, ' ');
     break;
   case '-': /* Moves cursor to a specified text segment                      */
-    /* not supported: text segments */
-    logDecode("NOT SUPPORTED [ 0x1B 0x2D ] ");
     mode         = E_GOTO_SEGMENT;
     break;
   case '.': /* Clears all unprotected characters positions with a character  */
     mode         = E_FILL_SCREEN;
     break;
   case '/':{/* Transmits the active text segment number and cursor address   */
-    /* not supported: text segments */
     char buffer[4];
     logDecode("sendCursorAddress()");
-    buffer[0]    = ' ';
-    buffer[1]    = (char)(currentBuffer->cursorY + 32);
+    buffer[0]    = (char)(activeSegment + 32);
+    buffer[1]    = (char)(currentBuffer->cursorY - segmentTop() + 32);
     buffer[2]    = (char)(currentBuffer->cursorX + 32);
     buffer[3]    = '\r';
     sendUserInput(pty, buffer, 4);
@@ -3728,22 +6221,21 @@ static void escape(int pty,char ch) {
     logDecode("clearTabStop() /* NOT SUPPORTED */");
     break;
   case '4': /* Sends all unprotected characters from the start of row to host*/
-    /* not supported: screen sending */
-    logDecode("sendAllUnprotectedCharactersFromStartOfRow() "
-              "/* NOT SUPPORTED */");
+    logDecode("sendAllUnprotectedCharactersFromStartOfRow()");
+    sendScreen(pty, 1, 1, 0);
     break;
   case '5': /* Sends all unprotected characters from the start of text to    */
             /*  host                                                         */
-    /* not supported: screen sending */
-    logDecode("sendAllUnprotectedCharacters() /* NOT SUPPORTED */");
+    logDecode("sendAllUnprotectedCharacters()");
+    sendScreen(pty, 0, 1, 0);
     break;
   case '6': /* Sends all characters from the start of row to the host        */
-    /* not supported: screen sending */
-    logDecode("sendAllCharactersFromStartOfRow() /* NOT SUPPORTED */");
+    logDecode("sendAllCharactersFromStartOfRow()");
+    sendScreen(pty, 1, 0, 0);
     break;
   case '7': /* Sends all characters from the start of text to the host       */
-    /* not supported: screen sending */
-    logDecode("sendAllCharacters() /* NOT SUPPORTED */");
+    logDecode("sendAllCharacters()");
+    sendScreen(pty, 0, 0, 0);
     break;
   case '8': /* Enters a start of message character (STX)                     */
     /* not supported: unknown */
@@ -3767,7 +6259,7 @@ static void escape(int pty,char ch) {
   case '?':{/* Transmits the cursor address for the active text segment      */
     char buffer[3];
     logDecode("sendCursorAddress()");
-    buffer[0]    = (char)(currentBuffer->cursorY + 32);
+    buffer[0]    = (char)(currentBuffer->cursorY - segmentTop() + 32);
     buffer[1]    = (char)(currentBuffer->cursorX + 32);
     buffer[2]    = '\r';
     sendUserInput(pty, buffer, 3);
@@ -3781,12 +6273,12 @@ static void escape(int pty,char ch) {
     mode         = E_SET_FIELD_ATTRIBUTE;
     break;
   case 'B': /* Places the terminal in block mode                             */
-    /* not supported: block mode */
-    logDecode("enableBlockMode() /* NOT SUPPORTED */");
+    logDecode("enableBlockMode()");
+    blockMode    = 1;
     break;
   case 'C': /* Places the terminal in conversation mode                      */
-    /* not supported: block mode */
-    logDecode("enableConversationMode() /* NOT SUPPORTED */");
+    logDecode("enableConversationMode()");
+    blockMode    = 0;
     break;
   case 'D': /* Sets full of half duplex conversation mode                    */
     /* not supported: block mode */
@@ -3795,6 +6287,10 @@ static void escape(int pty,char ch) {
     break;
   case 'E': /* Inserts a row of spaces                                       */
     logDecode("insertLine()");
+    if (isScreenSplit()) {
+      scrollSegment(currentBuffer->cursorY, segmentBottom(), -1);
+      break;
+    }
     moveScreenBuffer(currentBuffer,
                      0, currentBuffer->cursorY,
                      logicalWidth() - 1, logicalHeight() - 1,
@@ -3856,20 +6352,14 @@ static void escape(int pty,char ch) {
     break;
   case 'Q': /* Inserts a character                                           */
     logDecode("insertCharacter()");
-    _moveScreenBuffer(currentBuffer,
-                      currentBuffer->cursorX, currentBuffer->cursorY,
-                      logicalWidth() - 1, currentBuffer->cursorY,
-                      1, 0);
-    if (insert_character && strcmp(insert_character, "@"))
-      putCapability(insert_character);
-    else {
-      putCapability(enter_insert_mode);
-      putConsole(' ');
-      gotoXY(currentBuffer->cursorX, currentBuffer->cursorY);
-    }
+    shiftCharacters(1);
     break;
   case 'R': /* Deletes a row                                                 */
     logDecode("deleteLine()");
+    if (isScreenSplit()) {
+      scrollSegment(currentBuffer->cursorY, segmentBottom(), 1);
+      break;
+    }
     moveScreenBuffer(currentBuffer,
                      0, currentBuffer->cursorY + 1,
                      logicalWidth() - 1, logicalHeight() - 1,
@@ -3890,36 +6380,44 @@ static void escape(int pty,char ch) {
     break;
   case 'V':{/* Sets a protected column                                       */
     int x, y;
+    int oldY     = currentBuffer->cursorY;
+    int redraw   = 0;
+    Cell cell    = CELL(T_PROTECTED | protectedPersonality, ' ');
     x            = currentBuffer->cursorX;
     for (y = 0; y < logicalHeight(); y++) {
-      currentBuffer->attributes[y][x]  = T_PROTECTED | protectedPersonality;
-      currentBuffer->lineBuffer[y][x]  = ' ';
+      /* Only the column itself needs to be sent to the terminal             */
+      putCell(currentBuffer, x, y, cell);
+      if (x == screenWidth-1 && y == screenHeight-1)
+        redraw  |= !fillCorner();
+      else if (x < screenWidth && y < screenHeight) {
+        gotoXY(x, y);
+        drawCell(cell);
+        if (currentBuffer->cursorX >= screenWidth)
+          wrapCursor();
+      }
     }
-    displayCurrentScreenBuffer();
+    gotoXY(x, oldY);
+    if (redraw)
+      displayCurrentScreenBuffer();
     break; }
   case 'W': /* Deletes a character                                           */
     logDecode("deleteCharacter()");
-    _moveScreenBuffer(currentBuffer,
-                      currentBuffer->cursorX + 1, currentBuffer->cursorY,
-                      logicalWidth() - 1, currentBuffer->cursorY,
-                      -1, 0);
-    putCapability(delete_character);
+    shiftCharacters(-1);
     break;
   case 'X': /* Turns the monitor submode off                                 */
     /* not supported: monitor mode */
     logDecode("disableMonitorMode() /* NOT SUPPORTED */");
     break;
   case 'Y': /* Erases all characters to the end of the active text segment   */
-    /* not supported: text segments */
-    logDecode("clearToEndOfSegment() /* NOT SUPPORTED */");
-    clearEos();
+    logDecode("clearToEndOfSegment()");
+    clearEndOfSegment();
     break;
   case 'Z': /* Program function key sequence                                 */
     mode         = E_FUNCTION_KEY;
     break;
   case ']': /* Activates text segment zero                                   */
-    /* not supported: text segments */
-    logDecode("activateSegment(0) /* NOT SUPPORTED */");
+    logDecode("activateSegment(0)");
+    selectSegment(0);
     break;
   case '^': /* Select normal or reverse display                              */
     /* not supported: inverting the entire screen */
@@ -3962,12 +6460,12 @@ static void escape(int pty,char ch) {
     gotoXYscroll(currentBuffer->cursorX, currentBuffer->cursorY-1);
     break;
   case 'k': /* Turns local edit submode on                                   */
-    /* not supported: local edit mode */
-    logDecode("enableLocalEditMode() /* NOT SUPPORTED */");
+    logDecode("enableLocalEditMode()");
+    localEditMode = 1;
     break;
   case 'l': /* Turns duplex edit submode on                                  */
-    /* not supported: local edit mode */
-    logDecode("enableDuplexEditMode() /* NOT SUPPORTED */");
+    logDecode("enableDuplexEditMode()");
+    localEditMode = 0;
     break;
   case 'p': /* Sends all characters unformatted to auxiliary port            */
     /* not supported: auxiliary port */
@@ -3977,12 +6475,14 @@ static void escape(int pty,char ch) {
     logDecode("enableInsertMode()");
     if (enter_insert_mode && strcmp(enter_insert_mode, "@"))
       putCapability(enter_insert_mode);
+    commitOutput();
     insertMode = 1;
     break;
   case 'r': /* Turns the insert submode off                                  */
     logDecode("disableInsertMode()");
     if (insertMode && exit_insert_mode && strcmp(exit_insert_mode, "@"))
       putCapability(exit_insert_mode);
+    commitOutput();
     insertMode   = 0;
     break;
   case 's': /* Sends a message                                               */
@@ -4001,26 +6501,23 @@ static void escape(int pty,char ch) {
     mode         = E_SELECT_PAGE;
     break;
   case 'x': /* Changes the screen display format                             */
-    /* not supported: text segments */
     mode         = E_SET_SEGMENT_POSITION;
     break;
   case 'y': /* Erases all characters from the cursor to end of text segment  */
-    /* not supported: text segments */
-    logDecode("clearToEndOfSegment() /* NOT SUPPORTED */");
-    clearEos();
+    logDecode("clearToEndOfSegment()");
+    clearEndOfSegment();
     break;
   case 'z': /* Enters message into key label field                           */
     logDecode("setKeyLabel() /* NOT SUPPORTED */ [");
     mode         = E_SKIP_DEL;
     break;
   case '{': /* Moves cursor to home position of text segment                 */
-    /* not supported: text segments */
     logDecode("home()");
-    gotoXY(0, 0);
+    gotoXY(0, segmentTop());
     break;
   case '}': /* Activates text segment 1                                      */
-    /* not supported: text segments */
-    logDecode("activateSegment(0) /* NOT SUPPORTED */");
+    logDecode("activateSegment(1)");
+    selectSegment(1);
     break;
   case '~': /* Select personality                                            */
     /* not supported: personalities */
@@ -4079,8 +6576,10 @@ static void normal(int pty, char ch) {
     break;
   case '\x07': /* BEL: Sound beeper                                          */
     logDecode("bell()");
-    if (bell && strcmp(bell, "@"))
+    if (bell && strcmp(bell, "@")) {
+      commitOutput();
       putCapability(bell);
+    }
     logDecodeFlush();
     break;
   case '\x08':{/* BS:  Move cursor to the left                               */
@@ -4203,28 +6702,30 @@ static void normal(int pty, char ch) {
     logDecode("del() /* no action */");
     logDecodeFlush();
     break;
-  default:
+  default: {
     /* Things get ugly when we get to the right margin, because terminals    */
     /* behave differently depending on whether they support auto margins and */
     /* on whether they have the eat-newline glitch (or a variation thereof)  */
+    int printed                = 0;
+
     if (currentBuffer->cursorX == logicalWidth()-1 &&
         currentBuffer->cursorY == logicalHeight()-1) {
       /* If write protection has been enabled, then we do not want to auto-  */
       /* matically scroll the screen. This is rather difficult to implement  */
       /* because of the problems with writing to the very last character on  */
-      /* the screen. We work around the problem, by going through all the    */
-      /* steps for updating the the screen buffer and then forcing a full    */
-      /* redraw. The redraw code knows how to write the last line without    */
-      /* scrolling accidentally.                                             */
+      /* the screen. We work around the problem, by updating the screen      */
+      /* buffer and then filling in the corner without scrolling. If the     */
+      /* terminal cannot do that, force a full redraw instead.               */
       if (writeProtection) {
         int cursorX            = currentBuffer->cursorX;
         int cursorY            = currentBuffer->cursorY;
         if (protected || insertMode ||
-            (currentBuffer->attributes[cursorY][cursorX] & T_PROTECTED) == 0) {
-          int attributes       = currentAttributes;
+            (CELL_ATTRIBUTES(currentBuffer->cells[cursorY][cursorX]) &
+             T_PROTECTED) == 0) {
+          int attributes       = desiredAttributes();
           if (protected)
             attributes        |= T_PROTECTED;
-          if (currentAttributes & T_BLANK)
+          if (attributes & T_BLANK)
             ch                 = ' ';
           else if (graphicsMode || mode == E_GRAPHICS_CHARACTER) {
             if (ch >= '0' && ch <= '?')
@@ -4232,9 +6733,15 @@ static void normal(int pty, char ch) {
             else
               ch               = ' ';
           }
-          currentBuffer->attributes[cursorY][cursorX] = attributes;
-          currentBuffer->lineBuffer[cursorY][cursorX] = ch;
-          displayCurrentScreenBuffer();
+          putCell(currentBuffer, cursorX, cursorY, CELL(attributes, ch));
+          if (cursorX == screenWidth-1 && cursorY == screenHeight-1) {
+            if (!fillCorner())
+              displayCurrentScreenBuffer();
+          } else if (cursorX < screenWidth && cursorY < screenHeight) {
+            /* The emulated screen is smaller than the terminal              */
+            drawCell(currentBuffer->cells[cursorY][cursorX]);
+            currentBuffer->cursorX = cursorX;
+          }
         }
         break;
       } else {
@@ -4244,10 +6751,14 @@ static void normal(int pty, char ch) {
       }
     }
     if (insertMode) {
-      _moveScreenBuffer(currentBuffer,
-                        currentBuffer->cursorX, currentBuffer->cursorY,
-                        logicalWidth() - 1, currentBuffer->cursorY,
-                        1, 0);
+      if (graphicsMode || mode == E_GRAPHICS_CHARACTER) {
+        flushInsertRun();
+        _moveScreenBuffer(currentBuffer,
+                          currentBuffer->cursorX, currentBuffer->cursorY,
+                          logicalWidth() - 1, currentBuffer->cursorY,
+                          1, 0);
+      } else
+        insertCharacter();
       if (!enter_insert_mode || !strcmp(enter_insert_mode, "@"))
         putCapability(insert_character);
     }
@@ -4256,14 +6767,19 @@ static void normal(int pty, char ch) {
     /* protected characters unless 1) we are outputting write protected char-*/
     /* characters, or 2) insert mode is enabled                              */
     if (!writeProtection || protected || insertMode ||
-        (currentBuffer->attributes[currentBuffer->cursorY]
-                                  [currentBuffer->cursorX] & T_PROTECTED)==0) {
-      if (currentAttributes & T_BLANK)
+        (CELL_ATTRIBUTES(currentBuffer->cells[currentBuffer->cursorY]
+                                             [currentBuffer->cursorX]) &
+         T_PROTECTED) == 0) {
+      printed                  = 1;
+      if (desiredAttributes() & T_BLANK)
         putConsole(' ');
       else if (graphicsMode || mode == E_GRAPHICS_CHARACTER) {
         putGraphics(ch);
         mode                   = E_NORMAL;
-      } else
+        printed                = 0;
+      } else if (ch == ' ')
+        putBlank();
+      else
         putConsole(ch);
     } else if (currentBuffer->cursorX < logicalWidth()-1) {
       gotoXY(currentBuffer->cursorX + 1,
@@ -4271,21 +6787,17 @@ static void normal(int pty, char ch) {
       currentBuffer->cursorX--;
     }
     if (++currentBuffer->cursorX >= logicalWidth()) {
-      int x                    = 0;
-      int y                    = currentBuffer->cursorY + 1;
-
-      if (auto_right_margin && !eat_newline_glitch) {
-        currentBuffer->cursorX = 0;
-        currentBuffer->cursorY++;
-      } else
+      if (printed)
+        wrapCursor();
+      else {
+        /* We want the cursor at the beginning of the next line, but at this */
+        /* time we are not absolutely sure, we know where the cursor         */
+        /* currently is. Force it to where we need it.                       */
         currentBuffer->cursorX = logicalWidth()-1;
-
-      /* We want the cursor at the beginning of the next line, but at this   */
-      /* time we are not absolutely sure, we know where the cursor currently */
-      /* is. Force it to where we need it.                                   */
-      gotoXYforce(x,y);
+        gotoXYforce(0, currentBuffer->cursorY + 1);
+      }
     }
-    break;
+    break; }
   }
   return;
 }
@@ -4338,6 +6850,17 @@ static void outputCharacter(int pty, char ch) {
   } }
   #endif
 
+  /* Pending edits have to be completed, unless the next character continues */
+  /* them.                                                                   */
+  if (shiftCount &&
+      !(mode == E_NORMAL && ch == '\x1B') &&
+      !(mode == E_ESC && (ch == 'Q' || ch == 'W')))
+    flushCharacterShift();
+  if (insertRunCount &&
+      !(mode == E_NORMAL && (unsigned char)ch >= ' ' && ch != '\x7F' &&
+        insertMode && !graphicsMode))
+    flushInsertRun();
+
   switch (mode) {
   case E_GRAPHICS_CHARACTER:
     logDecode("enterGraphicsCharacter(0x%02X)", ch);
@@ -4371,11 +6894,14 @@ static void outputCharacter(int pty, char ch) {
       logDecode(" %02X", ch);
     break;
   case E_FILL_SCREEN:
+    mode                 = E_NORMAL;
     logDecode("fillScreen(0x%02x)", ch);
+    logDecodeFlush();
     fillScreen(T_NORMAL, ch);
     break;
   case E_GOTO_SEGMENT:
-    /* not supported: text segments */
+    logDecode("activateSegment(%d) ", ch & 1);
+    selectSegment(ch & 1);
     mode                 = E_GOTO_ROW_CODE;
     break;
   case E_GOTO_ROW_CODE:
@@ -4384,6 +6910,9 @@ static void outputCharacter(int pty, char ch) {
     break;
   case E_GOTO_COLUMN_CODE:
     logDecode("gotoXY(%d,%d)", (((int)ch)&0xFF) - 32, targetRow);
+    targetRow           += segmentTop();
+    if (targetRow > segmentBottom())
+      targetRow          = segmentBottom();
     gotoXY((((int)ch)&0xFF) - 32,targetRow);
     mode                 = E_NORMAL;
     logDecodeFlush();
@@ -4397,7 +6926,10 @@ static void outputCharacter(int pty, char ch) {
   case E_GOTO_COLUMN:
     if (ch == 'C') {
       logDecode("gotoXY(%d,%d)", targetColumn-1, targetRow-1);
-      gotoXY(targetColumn-1, targetRow-1);
+      targetRow         += segmentTop() - 1;
+      if (targetRow > segmentBottom())
+        targetRow        = segmentBottom();
+      gotoXY(targetColumn-1, targetRow);
       mode               = E_NORMAL;
       logDecodeFlush();
     } else
@@ -4489,24 +7021,38 @@ static void outputCharacter(int pty, char ch) {
     }
     break;
   case E_SET_SEGMENT_POSITION:
-    logDecode("NOT SUPPORTED [ 0x1B 0x78 0x%02X", ch);
     if (ch == '0') {
-      /* not supported: text segments */
-      logDecode(" ]");
+      logDecode("joinSegments()");
+      setSegmentSplit(0);
       mode               = E_NORMAL;
       logDecodeFlush();
+    } else if (ch == '1') {
+      mode               = E_SET_SEGMENT_SPLIT;
     } else {
-      /* not supported: text segments */
+      /* not supported: vertically split screens                             */
+      logDecode("NOT SUPPORTED [ 0x1B 0x78 0x%02X", ch);
       mode               = E_SKIP_ONE;
     }
     break;
+  case E_SET_SEGMENT_SPLIT:
+    logDecode("splitSegments(%d)", (((int)ch)&0xFF) - 32);
+    setSegmentSplit((((int)ch)&0xFF) - 32);
+    mode                 = E_NORMAL;
+    logDecodeFlush();
+    break;
   case E_SELECT_PAGE:
     switch (ch) {
     case 'G': /* Page size equals number of data lines                       */
+      logDecode("setPageLayout(1, 1, 1)");
+      setPageLayout(1, 1, 1);
+      break;
     case 'H': /* Page size is twice the number of data lines                 */
+      logDecode("setPageLayout(2, 2, 2)");
+      setPageLayout(2, 2, 2);
+      break;
     case 'J': /* 1st page is number of data lines,2nd page is remaining lines*/
-      /* not supported: splitting memory */
-      logDecode("NOT SUPPORTED [ 0x1B 0x77 0x%02X ]", ch);
+      logDecode("setPageLayout(1, 2, 1)");
+      setPageLayout(1, 2, 1);
       break;
     case 'B': /* Display previous page                                       */
       logDecode("displayPreviousPage()");
@@ -4576,6 +7122,13 @@ static void outputCharacter(int pty, char ch) {
 
 
 static void initKeyboardTranslations(void) {
+  /* The key for the history viewer takes precedence over all other keys     */
+  if (historyLimit > 0)
+    addKeyboardTranslation("Scrollback",
+                           *cfgScrollbackKey ? cfgScrollbackKey
+                                             : key_sprevious,
+                           historyKey);
+
   addKeyboardTranslation("A1",               key_a1,       cfgA1);
   addKeyboardTranslation("A3",               key_a3,       cfgA3);
   addKeyboardTranslation("B2",               key_b2,       cfgB2);
@@ -5013,12 +7566,41 @@ static void checkCapabilities(void) {
 }
 
 
+static int lineSpeed(speed_t speed) {
+  /* Converts the termios speed setting into bits per second                 */
+  static struct Speeds {
+    speed_t speed;
+    int     bitsPerSecond;
+  }         speeds[]         = {
+    { B50,         50 }, { B75,         75 }, { B110,       110 },
+    { B134,       134 }, { B150,       150 }, { B200,       200 },
+    { B300,       300 }, { B600,       600 }, { B1200,     1200 },
+    { B1800,     1800 }, { B2400,     2400 }, { B4800,     4800 },
+    { B9600,     9600 }, { B19200,   19200 }, { B38400,   38400 },
+#ifdef B57600
+    { B57600,   57600 },
+#endif
+#ifdef B115200
+    { B115200, 115200 },
+#endif
+#ifdef B230400
+    { B230400, 230400 },
+#endif
+  };
+  int       i;
+
+  for (i = sizeof(speeds)/sizeof(struct Speeds); i--; )
+    if (speeds[i].speed == speed)
+      return(speeds[i].bitsPerSecond);
+  return(0);
+}
+
+
 static void initTerminal(int pty) {
   static int       isRunning   = 0;
   char             buffer[80];
   struct termios   termios;
   struct winsize   win;
-  int              i;
 
   /* Determine initial screen size                                           */
   if (ioctl(1, TIOCGWINSZ, &win) < 0 ||
@@ -5053,6 +7635,7 @@ static void initTerminal(int pty) {
 
   needsReset                   = 1;
   setupterm(NULL, 1, NULL);
+  outputBaudRate               = lineSpeed(cfgetospeed(&defaultTermios));
 
   checkCapabilities();
   sendResetStrings();
@@ -5074,20 +7657,14 @@ static void initTerminal(int pty) {
   tcsetattr(0, TCSANOW, &termios);
  
   if (!isRunning) {
-    /* Enable all of our screen buffers                                      */
-    for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++)
-      screenBuffer[i]          = adjustScreenBuffer(NULL,
-                                                    screenWidth, screenHeight);
-    currentBuffer              = screenBuffer[currentPage];
+    /* Enable our screen buffer                                              */
+    adjustScreenBuffers(screenWidth, screenHeight);
   } else {
     int oldWidth               = logicalWidth();
     int oldHeight              = logicalHeight();
 
     /* Enable all of our screen buffers                                      */
-    for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++)
-      screenBuffer[i]          = adjustScreenBuffer(screenBuffer[i],
-                                                    screenWidth, screenHeight);
-    currentBuffer              = screenBuffer[currentPage];
+    adjustScreenBuffers(screenWidth, screenHeight);
     screenWidth                = win.ws_col;
     screenHeight               = win.ws_row;
     requestNewGeometry(pty, oldWidth, oldHeight);
@@ -5137,6 +7714,39 @@ static void initTerminal(int pty) {
 }
 
 
+static long currentTime(void) {
+  /* Returns a time stamp in milliseconds                                    */
+  struct timeval timeValue;
+
+  gettimeofday(&timeValue, 0);
+  return(timeValue.tv_sec*1000L + timeValue.tv_usec/1000);
+}
+
+
+static void resizeScreen(int pty) {
+  /* Adopts the current size of the terminal, redraws the screen and lets    */
+  /* the application know, if its window size actually changed.              */
+  struct winsize win, childWin;
+
+  resizeTime            = 0;
+  historyViewOffset     = -1;
+  if (ioctl(1, TIOCGWINSZ, &win) >= 0 &&
+      win.ws_col > 0 && win.ws_row > 0) {
+    adjustScreenBuffers(win.ws_col, win.ws_row);
+    invalidateHostScreens();
+    compactionTime      = currentTime() + 10000;
+    screenWidth         = win.ws_col;
+    screenHeight        = win.ws_row;
+    displayCurrentScreenBuffer();
+    if (ioctl(pty, TIOCGWINSZ, &childWin) < 0 ||
+        childWin.ws_col != win.ws_col || childWin.ws_row != win.ws_row)
+      ioctl(pty, TIOCSWINSZ, &win);
+  }
+  useNominalGeometry    = 0;
+  return;
+}
+
+
 static void processSignal(int signalNumber, int pid, int pty) {
   switch (signalNumber) {
   case SIGHUP:
@@ -5164,6 +7774,7 @@ static void processSignal(int signalNumber, int pid, int pty) {
     sigset_t         mask;
     struct sigaction action, old;
 
+    historyViewOffset = -1;
     if (pid > 0)
       killpg(pid, SIGTSTP);
     _resetTerminal(0);
@@ -5176,27 +7787,20 @@ static void processSignal(int signalNumber, int pid, int pty) {
     sigaction(SIGTSTP, &action, &old);
     raise(SIGTSTP);
     sigaction(SIGTSTP, &old, NULL);
+    invalidateHostScreens();
     initTerminal(pty);
     if (pid > 0)
       kill(pid, SIGCONT);
     break; }
-  case SIGWINCH: {
-    struct winsize win;
-
-    if (ioctl(1, TIOCGWINSZ, &win) >= 0 &&
-        win.ws_col > 0 && win.ws_row > 0) {
-      int i;
-      for (i = 0; i < sizeof(screenBuffer)/sizeof(ScreenBuffer *); i++)
-        screenBuffer[i] = adjustScreenBuffer(screenBuffer[i],
-                                             win.ws_col, win.ws_row);
-      currentBuffer     = screenBuffer[currentPage];
-      screenWidth       = win.ws_col;
-      screenHeight      = win.ws_row;
-      displayCurrentScreenBuffer();
-      ioctl(pty, TIOCSWINSZ, &win);
-    }
-    useNominalGeometry  = 0;
-    break; }
+  case SIGWINCH:
+    if (pid < 0)
+      /* We are waiting for our own request to resize the screen             */
+      resizeScreen(pty);
+    else
+      /* Interactively resizing a window sends lots of signals. Only act on  */
+      /* the last one, once things have settled down for a moment.           */
+      resizeTime        = currentTime() + 100;
+    break;
   default:
     break;
   }
@@ -5204,12 +7808,182 @@ static void processSignal(int signalNumber, int pid, int pty) {
 }
 
 
+static int processOutput(int pty, const char *buffer, int count) {
+  /* Interprets output that was received from the application. Rendering a   */
+  /* large block can take a while, so stop early if the user starts typing   */
+  /* or if the time slice runs out. Returns the number of bytes consumed.    */
+  long deadline;
+  int  i;
+
+  if (count <= 0)
+    return(0);
+  deadline                   = currentTime() + 20;
+  hidePredictions();
+  startCursorBurst(count);
+  if (!skippingOutput)
+    setOutputCheckpoint();
+  for (i = 0; i < count; i++) {
+    if (i && !(i % 256) &&
+        (keyboardPending() || currentTime() >= deadline))
+      break;
+    if (isPrinting != P_OFF) {
+      if (buffer[i] == '\x14') {
+        isPrinting           = P_OFF;
+        flushPrinter();
+      } else {
+        sendToPrinter(buffer+i, 1);
+      }
+    }
+    if (isPrinting == P_OFF || isPrinting == P_AUXILIARY)
+      outputCharacter(pty, buffer[i]);
+  }
+  flushEdits();
+  if (!skippingOutput)
+    optimizeOutput();
+  if (predictionCount) {
+    checkPredictions();
+    showPredictions();
+  }
+  logCharacters(1, buffer, i);
+  return(i);
+}
+
+
+static void resendTerminalModes(void) {
+  /* The terminal might not be in the state that we expect, e.g. because     */
+  /* some output never made it there. Send the modes and attributes again.   */
+  int hidden                 = hostCursorIsHidden;
+
+  blankCount                 = 0;
+  scrollPending              = 0;
+  cursorWrapped              = 0;
+  if (exit_alt_charset_mode && strcmp(exit_alt_charset_mode, "@"))
+    _putCapability(exit_alt_charset_mode);
+  if (auto_right_margin && enter_am_mode && strcmp(enter_am_mode, "@"))
+    _putCapability(enter_am_mode);
+  if (insertMode) {
+    if (enter_insert_mode && strcmp(enter_insert_mode, "@"))
+      _putCapability(enter_insert_mode);
+  } else if (exit_insert_mode && strcmp(exit_insert_mode, "@"))
+    _putCapability(exit_insert_mode);
+  hostCursorIsHidden         = !hidden;
+  setHostCursor(!hidden);
+  currentAttributes          = -1;
+  return;
+}
+
+
+static void startSkippingOutput(void) {
+  /* The terminal has fallen too far behind. Remember what it is going to    */
+  /* show once it has caught up, and then stop sending it any more output.   */
+  /* The application's output still gets interpreted at full speed.          */
+  hidePredictions();
+  flushCursor();
+  setOutputCheckpoint();
+  skipPage                   = currentPage;
+  skippingOutput             = 1;
+  return;
+}
+
+
+static void stopSkippingOutput(void) {
+  /* The terminal caught up. Rather than replaying all of the intermediate   */
+  /* screens, only bring it up to date with the final state. Most of the     */
+  /* time, this means scrolling and redrawing the lines that changed.        */
+  int x                      = currentBuffer->cursorX;
+  int cursorY                = currentBuffer->cursorY;
+  int i, y;
+
+  skippingOutput             = 0;
+  resendTerminalModes();
+  if (hostScreen(currentPage) != hostScreen(skipPage))
+    _putCapability(hostScreen(currentPage) ? enter_ca_mode : exit_ca_mode);
+
+  /* Page switches while skipping never made it to the terminal, so the      */
+  /* other host screen cannot be trusted any longer.                         */
+  invalidateHostScreens();
+  if (historyViewOffset >= 0) {
+    gotoXYforce(x, cursorY);
+    showHistory();
+  } else if (checkpointBuffer == currentBuffer &&
+             checkpointWidth == screenWidth &&
+             checkpointHeight == screenHeight &&
+             hostScreen(currentPage) == hostScreen(skipPage)) {
+    /* Compare against the screen that the terminal still shows              */
+    checkpointLength         = outputBufferLength;
+    checkpointAttributes     = currentAttributes;
+    checkpointCursorHidden   = hostCursorIsHidden;
+    cursorPending            = 1;
+    cursorUnknown            = 0;
+    hostCursorX              = checkpointX;
+    hostCursorY              = checkpointY;
+    for (y = 0; y < screenHeight; y++)
+      if (compareCells(currentBuffer->cells[y],
+                       checkpointCells + y*screenWidth,
+                       screenWidth) < screenWidth)
+        displayRows(y, y);
+    gotoXY(x, cursorY);
+    optimizeOutput();
+  } else {
+    gotoXYforce(x, cursorY);
+    displayCurrentScreenBuffer();
+  }
+  for (i = 0; i < predictionCount; i++)
+    predictions[i].shown     = 0;
+  showPredictions();
+  return;
+}
+
+
+#ifdef TIOCPKT
+static void discardOutput(void) {
+  /* The application's output has been flushed (e.g. by an interrupt). Any   */
+  /* output that is still queued up for the terminal is now stale, too.      */
+  /* Throw it away, and then repaint the screen from our buffer. As the      */
+  /* discarded output could have stopped half way through a sequence, the    */
+  /* terminal modes and attributes have to be sent again as well.            */
+  tcflush(1, TCOFLUSH);
+  outputBufferLength         = 0;
+  checkpointLength           = -1;
+
+  /* If output is being skipped, the terminal also lost some of the output   */
+  /* that the checkpoint expects it to show. Resync with a full repaint.     */
+  checkpointBuffer           = NULL;
+  resendTerminalModes();
+  invalidateHostScreens();
+  gotoXYforce(currentBuffer->cursorX, currentBuffer->cursorY);
+  displayCurrentScreenBuffer();
+  return;
+}
+
+
+static void ptyStateChanged(int flags) {
+  /* In packet mode, the pty tells us whenever the line discipline flushes   */
+  /* or stops the application's output (e.g. after ^C or ^S).                */
+  if (flags & TIOCPKT_FLUSHWRITE)
+    discardOutput();
+  if (flags & TIOCPKT_STOP)
+    outputStopped            = 1;
+  if (flags & TIOCPKT_START)
+    outputStopped            = 0;
+  return;
+}
+#endif
+
+
 static int emulator(int pid, int pty, int *status) {
   struct pollfd descriptors[2];
   sigset_t      unblocked, blocked;
   char          buffer[8192];
-  int           count, i;
+  int           count, i, busy;
+  /* Signal handlers siglongjmp() back into this function, so any state that */
+  /* changes inside of the main loop must not live in automatic variables.   */
+  static char   output[8192];
+  static int    outputOffset, outputLength, congested, throttled;
   int           discardEmptyMsg= streamsIO;
+#ifdef DEBUG_LOG_LATENCY
+  long          lookTime       = currentTime(), waitingSince, now;
+#endif
 
   descriptors[0].fd            = 0;
   descriptors[0].events        = POLLIN;
@@ -5230,20 +8004,103 @@ static int emulator(int pid, int pty, int *status) {
       extraDataLength          = 0;
     }
 
-    flushConsole();
+    if (resizeTime && currentTime() >= resizeTime)
+      resizeScreen(pty);
+    if (outputOffset == outputLength || outputStopped)
+      endCursorBurst(pty);
+    drainConsole();
     flushUserInput(pty);
 
+    /* On slow connections, the terminal can fall far behind the application.*/
+    /* Once too much output is waiting to be sent, either stop rendering and */
+    /* stop reading from the application, until the backlog has mostly       */
+    /* drained; the application then blocks, just like it would on a real    */
+    /* terminal. Or keep going, but skip sending intermediate screens.       */
+    if (flowControl != F_OFF) {
+      int backlog              = hostBacklog();
+      if (backlog > highWatermark)
+        congested              = 1;
+      else if (backlog <= lowWatermark)
+        congested              = 0;
+      if (flowControl == F_SKIP && congested != skippingOutput) {
+        if (congested)
+          startSkippingOutput();
+        else
+          stopSkippingOutput();
+      }
+      throttled                = congested && flowControl == F_BLOCK;
+    }
+
+    /* Stop reading from the application while the history viewer is open,   */
+    /* while its output has been stopped, or while we are still busy with    */
+    /* earlier output. If stopped, we still have to watch out for the packet */
+    /* that restarts the output, though.                                     */
+    busy                       = outputBufferLength > 0 ||
+                                 (outputOffset < outputLength &&
+                                  historyViewOffset < 0 && !outputStopped &&
+                                  !throttled);
+    descriptors[1].events      = historyViewOffset >= 0 ? 0 :
+                                 outputStopped ? POLLPRI :
+                                 outputOffset < outputLength || throttled
+                                 ? 0 : POLLIN;
     i                          = currentKeySequence != NULL ? 200 : -1;
+    if (busy) {
+      /* Check for keyboard input, then continue with the pending output     */
+      i                        = 0;
+    } else if (compactionTime) {
+      /* After the screen has been resized, wait until the session has been  */
+      /* idle for a while and then release any excess screen buffer memory.  */
+      long delay               = compactionTime - currentTime();
+      if (delay < 1000)
+        delay                  = 1000;
+      if (i < 0 || delay < i)
+        i                      = delay;
+    }
+    if (congested && (i < 0 || i > 20)) {
+      /* There is no event for the output queue draining; check again soon   */
+      i                        = 20;
+    }
+    if (resizeTime) {
+      long delay               = resizeTime - currentTime();
+      if (delay < 0)
+        delay                  = 0;
+      if (i < 0 || delay < i)
+        i                      = delay;
+    }
+    if (predictionCount) {
+      /* Give up on predicted echos that never arrive                        */
+      long delay               = predictions[0].time + 2000 - currentTime();
+      if (delay < 0)
+        delay                  = 0;
+      if (i < 0 || delay < i)
+        i                      = delay;
+    }
+#ifdef DEBUG_LOG_LATENCY
+    now                        = currentTime();
+#endif
     sigprocmask(SIG_SETMASK, &unblocked, &blocked);
     i                          = poll(descriptors, 2, i);
     sigprocmask(SIG_SETMASK, &blocked, NULL);
+#ifdef DEBUG_LOG_LATENCY
+    /* If poll() returned right away, keyboard input could have been waiting */
+    /* ever since the last time that we checked.                             */
+    waitingSince               = currentTime();
+    if (waitingSince <= now)
+      waitingSince             = lookTime;
+    lookTime                   = currentTime();
+#endif
 
     kill(pid, SIGCONT);
 
     if (i < 0) {
       if (errno != EINTR)
         break;
-    } else if (i == 0) {
+    } else if (i == 0 && !busy) {
+      if (predictionCount)
+        checkPredictions();
+      if (compactionTime && currentTime() >= compactionTime &&
+          historyViewOffset < 0)
+        compactScreenBuffers();
       if (currentKeySequence != NULL) {
         const char *keys       = currentKeySequence->name == NULL ?
                                  currentKeySequence->nativeKeys :
@@ -5265,28 +8122,43 @@ static int emulator(int pid, int pty, int *status) {
 
       if (keyboardEvents & POLLIN) {
         if ((count             = read(0, buffer, sizeof(buffer))) > 0) {
+          /* Keystrokes go to the application right away, before we spend    */
+          /* any time on rendering its output.                               */
           userInputReceived(pty, buffer, count);
+          flushUserInput(pty);
+          logLatency(waitingSince);
         } else if (count == 0 ||
                    (count < 0 && errno != EINTR)) {
           break;
         }
       }
 
-      if (ptyEvents & POLLIN) {
-        if ((count             = read(pty, buffer, sizeof(buffer))) > 0) {
-          logCharacters(1, buffer, count);
-          for (i = 0; i < count; i++) {
-            if (isPrinting != P_OFF) {
-              if (buffer[i] == '\x14') {
-                isPrinting     = P_OFF;
-                flushPrinter();
-              } else {
-                sendToPrinter(buffer+i, 1);
-              }
+      if (ptyEvents & (POLLIN|POLLPRI)) {
+        /* Application output gets queued up, and is then rendered in slices */
+        /* so that we never go for long without checking the keyboard.       */
+        memmove(output, output + outputOffset, outputLength - outputOffset);
+        outputLength          -= outputOffset;
+        outputOffset           = 0;
+        if ((count             = read(pty, buffer,
+                                      sizeof(buffer) - outputLength)) > 0) {
+          char *data           = buffer;
+#ifdef TIOCPKT
+          if (packetMode) {
+            /* Each packet starts with a header byte that is either zero for */
+            /* regular data or a set of flags describing a state change.     */
+            if (*buffer != TIOCPKT_DATA) {
+              if (*buffer & TIOCPKT_FLUSHWRITE)
+                /* Anything that we have not rendered yet is stale now       */
+                outputLength   = 0;
+              ptyStateChanged(*buffer);
+              count            = 1;
             }
-            if (isPrinting == P_OFF || isPrinting == P_AUXILIARY)
-              outputCharacter(pty, buffer[i]);
+            data++;
+            count--;
           }
+#endif
+          memcpy(output + outputLength, data, count);
+          outputLength        += count;
         } else if ((count == 0 && !discardEmptyMsg) ||
                    (count < 0 && errno != EINTR)) {
           break;
@@ -5294,12 +8166,24 @@ static int emulator(int pid, int pty, int *status) {
       }
 
       if ((keyboardEvents | ptyEvents) & (POLLERR|POLLHUP|POLLNVAL)) {
+        /* Show whatever the application sent before it went away            */
+        while (outputOffset < outputLength)
+          outputOffset        += processOutput(pty, output + outputOffset,
+                                               outputLength - outputOffset);
         break;
       }
 
       discardEmptyMsg          = 0;
     }
+
+    if (outputOffset < outputLength && historyViewOffset < 0 &&
+        !outputStopped && !throttled &&
+        (!outputBufferLength || skippingOutput))
+      outputOffset            += processOutput(pty, output + outputOffset,
+                                               outputLength - outputOffset);
   }
+  if (skippingOutput)
+    stopSkippingOutput();
   flushPrinter();
   flushConsole();
 
@@ -5408,6 +8292,15 @@ static int forkPty(int *fd, char *name) {
     streamsIO        = 1;
 #endif
 
+#ifdef TIOCPKT
+  /* Packet mode lets us find out when the application's output gets flushed */
+  /* or stopped. STREAMS based ptys deliver these notifications differently  */
+  if (!streamsIO) {
+    int on           = 1;
+    packetMode       = ioctl(master, TIOCPKT, &on) == 0;
+  }
+#endif
+
   /* Set new window size                                                     */
   if (ioctl(1, TIOCGWINSZ, &win) < 0 ||
       win.ws_col <= 0 || win.ws_row <= 0) {
@@ -5584,6 +8477,9 @@ static void execChild(int noPty, char *argv[]) {
 #ifdef DEBUG_DECODE
   unsetenv("WY60DECODE");
 #endif
+#ifdef DEBUG_LOG_LATENCY
+  unsetenv("WY60LATENCY");
+#endif
 #endif
   if ((appName = shell            = commandName) == NULL) {
     shell                         = getenv("SHELL");
@@ -5714,6 +8610,14 @@ static int setVariable(const char *key, const char *value) {
     { "RESIZE",              &cfgResize },
     { "WRITEPROTECT",        &cfgWriteProtect },
     { "PRINTCOMMAND",        &cfgPrintCommand },
+    { "ATTRIBUTESPANS",      &cfgAttributeSpans },
+    { "SCROLLBACK",          &cfgScrollback },
+    { "SCROLLBACKKEY",       &cfgScrollbackKey },
+    { "HIDECURSOR",          &cfgHideCursor },
+    { "PREDICTIVEECHO",      &cfgPredictiveEcho },
+    { "FLOWCONTROL",         &cfgFlowControl },
+    { "HIGHWATERMARK",       &cfgHighWatermark },
+    { "LOWWATERMARK",        &cfgLowWatermark },
     { "A1",                  &cfgA1 },
     { "A3",                  &cfgA3 },
     { "B2",                  &cfgB2 },
@@ -6157,7 +9061,63 @@ static void parseConfigurationFiles(void) {
 }
 
 
+static int parseSwitch(const char *name, const char *value) {
+  if (!strcasecmp(value, "on"))
+    return(1);
+  else if (!strcasecmp(value, "off"))
+    return(0);
+  failure(127, "%s can be either \"on\" or \"off\"; unknown value: \"%s\"\n",
+          name, value);
+  return(0);
+}
+
+
 static void commitConfiguration(void) {
+  useAttributeSpans           = parseSwitch("ATTRIBUTESPANS",
+                                            cfgAttributeSpans);
+  predictiveEcho              = parseSwitch("PREDICTIVEECHO",
+                                            cfgPredictiveEcho);
+  if (cfgScrollback && *cfgScrollback) {
+    char *end;
+
+    historyLimit              = strtol(cfgScrollback, &end, 10) * 1024;
+    if (*end || historyLimit < 0)
+      failure(127, "Cannot parse scrollback size: \"%s\"\n", cfgScrollback);
+  }
+  if (cfgHideCursor && *cfgHideCursor) {
+    char *end;
+
+    cursorBurstSize           = strtol(cfgHideCursor, &end, 10);
+    if (*end || cursorBurstSize < 0)
+      failure(127, "Cannot parse cursor hiding threshold: \"%s\"\n",
+              cfgHideCursor);
+  }
+  if (!strcasecmp(cfgFlowControl, "off"))
+    flowControl               = F_OFF;
+  else if (!strcasecmp(cfgFlowControl, "block"))
+    flowControl               = F_BLOCK;
+  else if (!strcasecmp(cfgFlowControl, "skip"))
+    flowControl               = F_SKIP;
+  else
+    failure(127, "FLOWCONTROL can be \"off\", \"block\", or \"skip\"; "
+            "unknown value: \"%s\"\n", cfgFlowControl);
+  if (cfgHighWatermark && *cfgHighWatermark) {
+    char *end;
+
+    highWatermark             = strtol(cfgHighWatermark, &end, 10);
+    if (*end || highWatermark <= 0)
+      failure(127, "Cannot parse high watermark: \"%s\"\n", cfgHighWatermark);
+  }
+  if (cfgLowWatermark && *cfgLowWatermark) {
+    char *end;
+
+    lowWatermark              = strtol(cfgLowWatermark, &end, 10);
+    if (*end || lowWatermark < 0)
+      failure(127, "Cannot parse low watermark: \"%s\"\n", cfgLowWatermark);
+    if (lowWatermark > highWatermark)
+      failure(127, "LOWWATERMARK must not exceed HIGHWATERMARK\n");
+  } else
+    lowWatermark              = highWatermark / 4;
   if (cfgWriteProtect && *cfgWriteProtect) {
     static const struct lookup {
       const char *name;